@@ -0,0 +1,162 @@
+#include "bvh.hpp"
+
+#include <numeric>
+
+namespace soft_render {
+
+namespace {
+
+struct sphere_objects_t {
+  std::span<const sphere_geometry_t> spheres;
+
+  [[nodiscard]] size_t size() const noexcept { return spheres.size(); }
+  [[nodiscard]] aabb_t bounds(size_t i) const noexcept {
+    return aabb_t::of(spheres[i]);
+  }
+  [[nodiscard]] glm::vec3 center(size_t i) const noexcept {
+    return spheres[i].position;
+  }
+};
+
+struct box_objects_t {
+  std::span<const aabb_t> boxes;
+
+  [[nodiscard]] size_t size() const noexcept { return boxes.size(); }
+  [[nodiscard]] aabb_t bounds(size_t i) const noexcept { return boxes[i]; }
+  [[nodiscard]] glm::vec3 center(size_t i) const noexcept {
+    return (boxes[i].min + boxes[i].max) * 0.5f;
+  }
+};
+
+} // namespace
+
+void bvh_t::build(std::span<const sphere_geometry_t> spheres) {
+  build_over(sphere_objects_t{spheres});
+}
+
+void bvh_t::build(std::span<const aabb_t> boxes) {
+  build_over(box_objects_t{boxes});
+}
+
+void bvh_t::refit(std::span<const sphere_geometry_t> spheres,
+                  std::span<const size_t> changed) {
+  refit_over(sphere_objects_t{spheres}, changed);
+}
+
+void bvh_t::refit(std::span<const aabb_t> boxes,
+                  std::span<const size_t> changed) {
+  refit_over(box_objects_t{boxes}, changed);
+}
+
+template <typename Objects> void bvh_t::build_over(const Objects &objects) {
+  nodes_.clear();
+  objects_.resize(objects.size());
+  std::iota(objects_.begin(), objects_.end(), 0u);
+  leaf_of_.assign(objects.size(), 0);
+  weighted_area_ = 0.0;
+  build_cost_ = 0.0;
+
+  if (objects.size() == 0) {
+    return;
+  }
+
+  nodes_.reserve(2 * objects.size());
+  nodes_.emplace_back();
+  subdivide(objects, 0, 0, static_cast<uint32_t>(objects.size()));
+
+  for (const auto &node : nodes_) {
+    weighted_area_ += node.bounds.surface_area() * node_weight(node);
+  }
+  const double root_area = nodes_[0].bounds.surface_area();
+  build_cost_ = root_area > 0.0 ? weighted_area_ / root_area : 0.0;
+}
+
+template <typename Objects>
+void bvh_t::subdivide(const Objects &objects, uint32_t node, uint32_t begin,
+                      uint32_t end) {
+  aabb_t bounds;
+  aabb_t centroids;
+  for (uint32_t i = begin; i < end; ++i) {
+    bounds.grow(objects.bounds(objects_[i]));
+    centroids.grow(objects.center(objects_[i]));
+  }
+  nodes_[node].bounds = bounds;
+
+  const glm::vec3 extent = centroids.extent();
+  const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0
+                   : extent.y >= extent.z                        ? 1
+                                                                 : 2;
+  // Objects sharing a centroid can't be split, they stay in one leaf.
+  if (end - begin <= max_leaf_size || extent[axis] <= 0.0f) {
+    nodes_[node].first = begin;
+    nodes_[node].count = end - begin;
+    for (uint32_t i = begin; i < end; ++i) {
+      leaf_of_[objects_[i]] = node;
+    }
+    return;
+  }
+
+  const uint32_t middle = begin + (end - begin) / 2;
+  std::nth_element(objects_.begin() + begin, objects_.begin() + middle,
+                   objects_.begin() + end, [&](uint32_t l, uint32_t r) {
+                     return objects.center(l)[axis] <
+                            objects.center(r)[axis];
+                   });
+
+  const auto left = static_cast<uint32_t>(nodes_.size());
+  nodes_.emplace_back().parent = node;
+  nodes_.emplace_back().parent = node;
+  nodes_[node].first = left;
+  nodes_[node].count = 0;
+
+  subdivide(objects, left, begin, middle);
+  subdivide(objects, left + 1, middle, end);
+}
+
+template <typename Objects>
+aabb_t bvh_t::leaf_bounds(const Objects &objects,
+                          const node_t &node) const noexcept {
+  aabb_t bounds;
+  for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+    bounds.grow(objects.bounds(objects_[i]));
+  }
+  return bounds;
+}
+
+void bvh_t::set_bounds(uint32_t node, const aabb_t &bounds) noexcept {
+  node_t &n = nodes_[node];
+  weighted_area_ += static_cast<double>(bounds.surface_area() -
+                                        n.bounds.surface_area()) *
+                    node_weight(n);
+  n.bounds = bounds;
+}
+
+template <typename Objects>
+void bvh_t::refit_over(const Objects &objects,
+                       std::span<const size_t> changed) {
+  for (const size_t object : changed) {
+    uint32_t node = leaf_of_[object];
+    aabb_t bounds = leaf_bounds(objects, nodes_[node]);
+    // Walk up while something changes. A parent that already matches its
+    // children was fixed by an earlier object in the same leaf or subtree.
+    while (bounds != nodes_[node].bounds) {
+      set_bounds(node, bounds);
+      node = nodes_[node].parent;
+      if (node == no_parent) {
+        break;
+      }
+      bounds = nodes_[nodes_[node].first].bounds;
+      bounds.grow(nodes_[nodes_[node].first + 1].bounds);
+    }
+  }
+}
+
+float bvh_t::degradation() const noexcept {
+  const double root_area = empty() ? 0.0 : nodes_[0].bounds.surface_area();
+  if (root_area <= 0.0 || build_cost_ <= 0.0) {
+    return 1.0f;
+  }
+  return static_cast<float>(weighted_area_ / root_area / build_cost_);
+}
+
+} // namespace soft_render
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <soft-render/geometry.hpp>
+
+namespace soft_render {
+
+struct aabb_t {
+  glm::vec3 min = glm::vec3(std::numeric_limits<float>::infinity());
+  glm::vec3 max = glm::vec3(-std::numeric_limits<float>::infinity());
+
+  [[nodiscard]] static aabb_t of(const sphere_geometry_t &sphere) noexcept {
+    return {sphere.position - sphere.radius, sphere.position + sphere.radius};
+  }
+
+  void grow(const aabb_t &other) noexcept {
+    min = glm::min(min, other.min);
+    max = glm::max(max, other.max);
+  }
+
+  void grow(glm::vec3 point) noexcept {
+    min = glm::min(min, point);
+    max = glm::max(max, point);
+  }
+
+  [[nodiscard]] glm::vec3 extent() const noexcept { return max - min; }
+
+  [[nodiscard]] bool overlaps(const aabb_t &other) const noexcept {
+    return min.x <= other.max.x && min.y <= other.max.y &&
+           min.z <= other.max.z && other.min.x <= max.x &&
+           other.min.y <= max.y && other.min.z <= max.z;
+  }
+
+  [[nodiscard]] float surface_area() const noexcept {
+    const glm::vec3 e = extent();
+    if (e.x < 0 || e.y < 0 || e.z < 0) {
+      return 0.0f;
+    }
+    return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+  }
+
+  /**
+   * Slab test.
+   *
+   * @return the distance where the ray enters the box within [t_min, t_max],
+   * infinity if it misses.
+   */
+  [[nodiscard]] float intersect(const ray_t &ray, float t_min,
+                                float t_max) const noexcept {
+    float enter = t_min;
+    float exit = t_max;
+    for (glm::length_t axis = 0; axis < 3; ++axis) {
+      float t0 = (min[axis] - ray.origin[axis]) * ray.inv_direction[axis];
+      float t1 = (max[axis] - ray.origin[axis]) * ray.inv_direction[axis];
+      if (t0 > t1) {
+        std::swap(t0, t1);
+      }
+      // NaN (the origin on a slab plane of an axis parallel ray) loses both
+      // comparisons and keeps the current range.
+      enter = t0 > enter ? t0 : enter;
+      exit = t1 < exit ? t1 : exit;
+    }
+    return enter <= exit ? enter : std::numeric_limits<float>::infinity();
+  }
+
+  friend bool operator==(const aabb_t &, const aabb_t &) noexcept = default;
+};
+
+/**
+ * Bounding volume hierarchy over spheres.
+ *
+ * It's built once and then refitted: when objects move, only the leaves that
+ * hold them and their ancestors are updated, the tree topology is kept. A
+ * refitted tree gets worse as objects drift away from their siblings, so it
+ * tracks its SAH cost and the owner rebuilds it once it degrades too much.
+ */
+class bvh_t {
+public:
+  static constexpr uint32_t max_leaf_size = 4;
+  static constexpr uint32_t no_parent = std::numeric_limits<uint32_t>::max();
+
+  struct node_t {
+    aabb_t bounds;
+    /// Inner node: the left child, the right one follows it.
+    /// Leaf: the first entry in the object list.
+    uint32_t first = 0;
+    /// Objects in the leaf, 0 for inner nodes.
+    uint32_t count = 0;
+    uint32_t parent = no_parent;
+
+    [[nodiscard]] bool leaf() const noexcept { return count != 0; }
+  };
+
+  void build(std::span<const sphere_geometry_t> spheres);
+  /// Over arbitrary boxes, split by their centers.
+  void build(std::span<const aabb_t> boxes);
+
+  /**
+   * Updates bounds of the leaves holding the `changed` objects and of their
+   * ancestors. Costs O(changed * depth), the topology doesn't change.
+   */
+  void refit(std::span<const sphere_geometry_t> spheres,
+             std::span<const size_t> changed);
+  void refit(std::span<const aabb_t> boxes, std::span<const size_t> changed);
+
+  /**
+   * @return SAH cost relative to the cost right after the last build. 1 for a
+   * fresh tree, it grows as refits make nodes overlap.
+   */
+  [[nodiscard]] float degradation() const noexcept;
+
+  [[nodiscard]] bool empty() const noexcept { return nodes_.empty(); }
+  [[nodiscard]] size_t size() const noexcept { return leaf_of_.size(); }
+
+  [[nodiscard]] const std::vector<node_t> &nodes() const noexcept {
+    return nodes_;
+  }
+
+  /**
+   * Calls `visit(object)` for every object whose leaf the ray hits, nearer
+   * nodes first. `visit` may shrink `t_max` (closest hit search) and returns
+   * true to stop the traversal (any hit search).
+   */
+  template <typename F>
+  void traverse(const ray_t &ray, float t_min, float &t_max,
+                F &&visit) const {
+    // The root isn't tested: it only saves work for rays that miss the whole
+    // scene, and it's a wasted test when the whole scene is a single leaf.
+    if (nodes_.empty()) {
+      return;
+    }
+
+    // Median splits keep the depth at log2(n / max_leaf_size), it's enough
+    // for any scene that fits in memory.
+    std::array<uint32_t, 64> stack;
+    size_t top = 0;
+    stack[top++] = 0;
+    while (top != 0) {
+      const node_t &node = nodes_[stack[--top]];
+      if (node.leaf()) {
+        for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+          if (visit(static_cast<size_t>(objects_[i]))) {
+            return;
+          }
+        }
+        continue;
+      }
+
+      const uint32_t left = node.first;
+      const uint32_t right = node.first + 1;
+      const float t_left = nodes_[left].bounds.intersect(ray, t_min, t_max);
+      const float t_right = nodes_[right].bounds.intersect(ray, t_min, t_max);
+      constexpr float miss = std::numeric_limits<float>::infinity();
+      // Push the far child first, so the near one is visited first and
+      // shrinks t_max for the other.
+      if (t_left <= t_right) {
+        if (t_right != miss)
+          stack[top++] = right;
+        if (t_left != miss)
+          stack[top++] = left;
+      } else {
+        if (t_left != miss)
+          stack[top++] = left;
+        if (t_right != miss)
+          stack[top++] = right;
+      }
+    }
+  }
+
+  /// Calls `visit(object)` for every object whose leaf overlaps the box.
+  template <typename F>
+  void for_each_overlapping(const aabb_t &box, F &&visit) const {
+    if (nodes_.empty()) {
+      return;
+    }
+    std::array<uint32_t, 64> stack;
+    size_t top = 0;
+    stack[top++] = 0;
+    while (top != 0) {
+      const node_t &node = nodes_[stack[--top]];
+      if (!node.bounds.overlaps(box)) {
+        continue;
+      }
+      if (node.leaf()) {
+        for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+          visit(static_cast<size_t>(objects_[i]));
+        }
+        continue;
+      }
+      stack[top++] = node.first;
+      stack[top++] = node.first + 1;
+    }
+  }
+
+private:
+  // `Objects` tell the bounds and the center of an object, see bvh.cpp.
+  template <typename Objects> void build_over(const Objects &objects);
+  template <typename Objects>
+  void subdivide(const Objects &objects, uint32_t node, uint32_t begin,
+                 uint32_t end);
+  template <typename Objects>
+  void refit_over(const Objects &objects, std::span<const size_t> changed);
+  template <typename Objects>
+  [[nodiscard]] aabb_t leaf_bounds(const Objects &objects,
+                                   const node_t &node) const noexcept;
+  [[nodiscard]] static float node_weight(const node_t &node) noexcept {
+    // Traversal and intersection costs are assumed equal.
+    return node.leaf() ? static_cast<float>(node.count) : 1.0f;
+  }
+  void set_bounds(uint32_t node, const aabb_t &bounds) noexcept;
+
+  std::vector<node_t> nodes_;
+  /// Object indices, each leaf owns a contiguous range.
+  std::vector<uint32_t> objects_;
+  /// Object index -> leaf node.
+  std::vector<uint32_t> leaf_of_;
+
+  /// Sum of node areas weighted by their cost, kept up to date by refits.
+  double weighted_area_ = 0.0;
+  double build_cost_ = 0.0;
+};
+
+} // namespace soft_render
@@ -0,0 +1,18 @@
+#include "fast_math.hpp"
+
+#include <cmath>
+
+namespace soft_render {
+
+highlight_table_t::highlight_table_t(float exponent) : exponent_(exponent) {
+  const float range = std::min(max_falloff / exponent, 1.0f);
+  scale_ = static_cast<float>(samples) / range;
+  for (size_t i = 0; i <= samples; ++i) {
+    const float x = 1.0f - range * static_cast<float>(i) / samples;
+    values_[i] = std::pow(x, exponent);
+  }
+  values_[samples] = 0.0f;
+  values_[samples + 1] = 0.0f;
+}
+
+} // namespace soft_render
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+// Approximations behind the fast shading math (see shading_math_t). They have
+// no branches and no library calls, so loops over them vectorize.
+
+namespace soft_render {
+
+/**
+ * 1/sqrt(x) for x > 0: the integer estimate refined by two Newton steps, the
+ * relative error is below 5e-6. One step (0.2%) isn't enough: highlights raise
+ * the dot product of two normalized vectors to powers up to 1000.
+ */
+[[nodiscard]] inline float fast_rsqrt(float x) noexcept {
+  float y =
+      std::bit_cast<float>(0x5f375a86u - (std::bit_cast<uint32_t>(x) >> 1));
+  y = y * (1.5f - 0.5f * x * y * y);
+  return y * (1.5f - 0.5f * x * y * y);
+}
+
+[[nodiscard]] inline glm::vec3 fast_normalize(glm::vec3 v) noexcept {
+  return v * fast_rsqrt(glm::dot(v, v));
+}
+
+/**
+ * x^exponent for x <= 1 sampled once, the specular highlight of a material
+ * without a std::pow per light.
+ *
+ * The samples cover x from 1 down to where the power falls below e^-8 (3e-4,
+ * a tenth of a color step), or down to 0 for small exponents; below that it's
+ * 0. Near 1 the power is about e^(-exponent * (1 - x)), so the same number of
+ * samples fits every exponent: linear interpolation is off by less than 1e-4.
+ */
+class highlight_table_t {
+public:
+  static constexpr size_t samples = 256;
+  /// The covered range is x in [1 - min(max_falloff / exponent, 1), 1].
+  static constexpr float max_falloff = 8.0f;
+
+  explicit highlight_table_t(float exponent);
+
+  [[nodiscard]] float exponent() const noexcept { return exponent_; }
+
+  [[nodiscard]] float operator()(float x) const noexcept {
+    // The last entry is 0 and covers everything beyond the range.
+    const float position = std::clamp((1.0f - x) * scale_, 0.0f,
+                                      static_cast<float>(samples));
+    const auto i = static_cast<size_t>(position);
+    const float fraction = position - static_cast<float>(i);
+    return values_[i] + (values_[i + 1] - values_[i]) * fraction;
+  }
+
+private:
+  float exponent_;
+  /// (1 - x) to the position in values_.
+  float scale_;
+  std::array<float, samples + 2> values_;
+};
+
+} // namespace soft_render
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <utility>
+
+#include <soft-render/mfb_color.hpp>
+#include <soft-render/viewport.hpp>
+
+namespace soft_render {
+
+class renderer;
+
+/// How the pixels of a frame are stored.
+enum class pixel_layout_t {
+  /// Row by row, the layout windows and image files take.
+  linear,
+  /// Square tiles stored one after another, see tiled_layout_t.
+  tiled,
+};
+
+/// @return the layout by its name ("linear", "tiled").
+[[nodiscard]] inline std::optional<pixel_layout_t>
+parse_pixel_layout(std::string_view name) noexcept {
+  if (name == "linear")
+    return pixel_layout_t::linear;
+  if (name == "tiled")
+    return pixel_layout_t::tiled;
+  return std::nullopt;
+}
+
+/**
+ * The tiled layout of a canvas: tile_size x tile_size tiles, row by row, with
+ * the pixels of a tile contiguous and row by row too. Edge tiles are padded to
+ * the full size. A tile the renderer works on is a single 4 KiB block instead
+ * of tile_size rows far apart, and the whole frame has to be detiled once
+ * before it's shown.
+ */
+struct tiled_layout_t {
+  static constexpr size_t tile_size = 32;
+
+  size_t width = 0;
+  size_t height = 0;
+
+  [[nodiscard]] static tiled_layout_t
+  of(const canvas_size_t &canvas_size) noexcept {
+    return {.width = canvas_size.width.as_size(),
+            .height = canvas_size.height.as_size()};
+  }
+
+  [[nodiscard]] size_t columns() const noexcept {
+    return (width + tile_size - 1) / tile_size;
+  }
+  [[nodiscard]] size_t rows() const noexcept {
+    return (height + tile_size - 1) / tile_size;
+  }
+  /// Pixels of a row of tiles.
+  [[nodiscard]] size_t row_size() const noexcept {
+    return columns() * tile_size * tile_size;
+  }
+  /// Pixels of the whole frame, padding included.
+  [[nodiscard]] size_t size() const noexcept { return rows() * row_size(); }
+
+  /// @return the index of the pixel (i, j).
+  [[nodiscard]] size_t offset(size_t i, size_t j) const noexcept {
+    return (j / tile_size) * row_size() +
+           (i / tile_size) * tile_size * tile_size +
+           (j % tile_size) * tile_size + i % tile_size;
+  }
+
+  /**
+   * Copies the tiled pixels to the linear `target` whose rows are `stride`
+   * pixels apart, a tile row (128 bytes) at a time.
+   */
+  void detile(std::span<const mfb_color> tiled, std::span<mfb_color> target,
+              size_t stride) const noexcept {
+    for (size_t j = 0; j < height; ++j) {
+      const mfb_color *source = tiled.data() + offset(0, j);
+      mfb_color *row = target.data() + j * stride;
+      for (size_t i = 0; i < width; i += tile_size) {
+        std::copy_n(source, std::min(tile_size, width - i), row + i);
+        source += tile_size * tile_size;
+      }
+    }
+  }
+};
+
+/**
+ * Frame pixels whose memory is first touched by the workers that render
+ * them (see renderer::make_framebuffer()). The OS backs a page with memory of
+ * the node that touches it first, so on a multi-socket machine every node
+ * writes its band of rows to local memory. A zero-initialized std::vector
+ * would put the whole frame on the node of the thread that created it.
+ */
+class framebuffer_t {
+public:
+  framebuffer_t() = default;
+
+  framebuffer_t(framebuffer_t &&other) noexcept
+      : pixels_(std::exchange(other.pixels_, nullptr)),
+        size_(std::exchange(other.size_, 0)) {}
+
+  framebuffer_t &operator=(framebuffer_t &&other) noexcept {
+    std::swap(pixels_, other.pixels_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+
+  ~framebuffer_t() {
+    // mfb_color is trivially destructible, the pixels just go away.
+    std::allocator<mfb_color>().deallocate(pixels_, size_);
+  }
+
+  [[nodiscard]] std::span<mfb_color> pixels() const noexcept {
+    return {pixels_, size_};
+  }
+  [[nodiscard]] mfb_color *data() const noexcept { return pixels_; }
+  [[nodiscard]] size_t size() const noexcept { return size_; }
+
+private:
+  friend class renderer;
+
+  /// Allocates, the owner constructs the pixels.
+  explicit framebuffer_t(size_t size)
+      : pixels_(std::allocator<mfb_color>().allocate(size)), size_(size) {}
+
+  mfb_color *pixels_ = nullptr;
+  size_t size_ = 0;
+};
+
+} // namespace soft_render
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+#include <glm/glm.hpp>
+
+#include <soft-render/scene.hpp>
+
+namespace soft_render {
+
+/**
+ * A ray with the invariants of the ray-sphere equation precomputed. They don't
+ * depend on a sphere, so they are computed once and shared by all spheres the
+ * ray is tested against.
+ */
+struct ray_t {
+  /// A point from where the ray is going.
+  glm::vec3 origin;
+  /// Not normalized: primary rays go from the camera to the projection plane.
+  glm::vec3 direction;
+  /// Per-axis inverse of the direction for slab tests against boxes.
+  glm::vec3 inv_direction;
+  /// <direction, direction>, the `a` coefficient of the quadratic equation.
+  float a;
+  float inv_a;
+
+  ray_t(glm::vec3 origin, glm::vec3 direction) noexcept
+      : origin(origin), direction(direction),
+        inv_direction(1.0f / direction), a(glm::dot(direction, direction)),
+        inv_a(1.0f / a) {}
+
+  [[nodiscard]] inline glm::vec3 at(float t) const noexcept {
+    return origin + direction * t;
+  }
+};
+
+/**
+ * Per-sphere constants used by intersection and shading. Materials stay in
+ * sphere_t, so the intersection loop only touches the data it needs.
+ */
+struct sphere_geometry_t {
+  glm::vec3 position;
+  float radius = 1.0f;
+  float radius2 = 1.0f;
+  /// Turns (point - position) into a unit normal without a sqrt.
+  float inv_radius = 1.0f;
+
+  sphere_geometry_t() = default;
+  explicit sphere_geometry_t(const sphere_t &sphere) noexcept
+      : position(sphere.position), radius(sphere.radius),
+        radius2(sphere.radius * sphere.radius),
+        inv_radius(1.0f / sphere.radius) {}
+
+  [[nodiscard]] inline glm::vec3 normal_at(glm::vec3 point) const noexcept {
+    return (point - position) * inv_radius;
+  }
+};
+
+/**
+ * Result of a closest intersection search.
+ */
+struct hit_t {
+  static constexpr size_t no_object = std::numeric_limits<size_t>::max();
+  static constexpr uint32_t no_instance = std::numeric_limits<uint32_t>::max();
+
+  /// A scene object, or a sphere of the prototype of the instance.
+  size_t object = no_object;
+  float t = std::numeric_limits<float>::infinity();
+  uint32_t instance = no_instance;
+
+  explicit operator bool() const noexcept { return object != no_object; }
+};
+
+/**
+ * The function simply finds intersections for a direction `ray` with a sphere
+ * by the following equation:
+ * <intersection_vec - sphere_vec, intersection_vec - sphere_vec> =
+ * sphere_radius ^ 2
+ *
+ * The intersections must be along the ray vector (it goes from camera position
+ * to a projection plane), so the intersection_vec is
+ * viewport_position + t * ray.
+ *
+ * The equation could be transformed to
+ * t^2 <ray,ray> + t (2 <viewport_position - sphere_vector, ray>) +
+ * <viewport_position - sphere_vector, viewport_position - sphere_vector> -
+ * r^2 = 0
+ *
+ * We use the half-b form of it (b = 2 * half_b), it cancels all the 2s and 4s
+ * and needs a single sqrt.
+ */
+[[nodiscard]] inline std::pair<float, float>
+intersect_ray_sphere(const ray_t &ray,
+                     const sphere_geometry_t &sphere) noexcept {
+  const glm::vec3 CO = ray.origin - sphere.position;
+
+  const float half_b = glm::dot(CO, ray.direction);
+  const float c = glm::dot(CO, CO) - sphere.radius2;
+
+  const float discriminant = half_b * half_b - ray.a * c;
+  if (discriminant < 0) {
+    return {std::numeric_limits<float>::infinity(),
+            std::numeric_limits<float>::infinity()};
+  }
+
+  const float root = std::sqrt(discriminant);
+  return {(-half_b + root) * ray.inv_a, (-half_b - root) * ray.inv_a};
+}
+
+} // namespace soft_render
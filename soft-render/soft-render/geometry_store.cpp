@@ -0,0 +1,155 @@
+#include "geometry_store.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace soft_render {
+
+namespace {
+
+/// World bounds of the prototype's box moved by the instance's transform.
+[[nodiscard]] aabb_t instance_bounds(const instance_t &instance,
+                                     const prototype_geometry_t &prototype) {
+  if (prototype.spheres.empty()) {
+    // Nothing to hit, a point keeps the box finite for the BVH build.
+    const glm::vec3 origin(instance.transform[3]);
+    return {origin, origin};
+  }
+  const aabb_t &box = prototype.bounds;
+  aabb_t bounds;
+  for (int corner = 0; corner < 8; ++corner) {
+    const glm::vec3 local((corner & 1) != 0 ? box.max.x : box.min.x,
+                          (corner & 2) != 0 ? box.max.y : box.min.y,
+                          (corner & 4) != 0 ? box.max.z : box.min.z);
+    bounds.grow(glm::vec3(instance.transform * glm::vec4(local, 1.0f)));
+  }
+  return bounds;
+}
+
+} // namespace
+
+prototype_geometry_t::prototype_geometry_t(const prototype_t &prototype) {
+  spheres.reserve(prototype.objects.size());
+  for (const auto &object : prototype.objects) {
+    bounds.grow(aabb_t::of(spheres.emplace_back(object)));
+  }
+  bvh.build(spheres);
+}
+
+void geometry_store_t::rebuild(const scene_t &scene) {
+  spheres_.clear();
+  spheres_.reserve(scene.objects.size());
+  for (const auto &object : scene.objects) {
+    spheres_.emplace_back(object);
+  }
+  bvh_.build(spheres_);
+  ++rebuilds_;
+}
+
+void geometry_store_t::rebuild_instances(const scene_t &scene,
+                                         bool same_scene) {
+  // Prototypes can only be added: the built ones stay valid for the same
+  // scene, no matter what happened to the instances.
+  if (!same_scene || prototypes_.size() > scene.prototypes.size()) {
+    prototypes_.clear();
+  }
+  prototypes_.reserve(scene.prototypes.size());
+  for (size_t i = prototypes_.size(); i < scene.prototypes.size(); ++i) {
+    prototypes_.emplace_back(scene.prototypes[i]);
+  }
+
+  instances_.resize(scene.instances.size());
+  instance_bounds_.resize(scene.instances.size());
+  for (size_t i = 0; i < scene.instances.size(); ++i) {
+    update_instance(scene, i);
+  }
+  instance_bvh_.build(instance_bounds_);
+  if (!instances_.empty()) {
+    ++rebuilds_;
+  }
+}
+
+void geometry_store_t::update_instance(const scene_t &scene, size_t index) {
+  const instance_t &instance = scene.instances[index];
+  assert(instance.prototype < prototypes_.size());
+  instances_[index] = instance_geometry_t(instance);
+  instance_bounds_[index] =
+      instance_bounds(instance, prototypes_[instance.prototype]);
+}
+
+void geometry_store_t::sync(const scene_t &scene) {
+  const bool same_scene = generation_ == scene.generation();
+  generation_ = scene.generation();
+  sync_objects(scene, same_scene);
+  sync_instances(scene, same_scene);
+}
+
+void geometry_store_t::sync_objects(const scene_t &scene, bool same_scene) {
+  same_scene = same_scene && spheres_.size() == scene.objects.size();
+  if (same_scene && revision_ == scene.revision()) {
+    return;
+  }
+
+  changed_.clear();
+  const bool replayed =
+      same_scene && scene.for_each_change(revision_, [this](size_t index) {
+        changed_.push_back(index);
+      });
+  revision_ = scene.revision();
+
+  if (!replayed) {
+    rebuild(scene);
+    return;
+  }
+
+  // An object may be changed several times between syncs.
+  std::sort(changed_.begin(), changed_.end());
+  changed_.erase(std::unique(changed_.begin(), changed_.end()),
+                 changed_.end());
+  for (const size_t index : changed_) {
+    spheres_[index] = sphere_geometry_t(scene.objects[index]);
+  }
+
+  bvh_.refit(spheres_, changed_);
+  if (bvh_.degradation() > max_bvh_degradation) {
+    bvh_.build(spheres_);
+    ++rebuilds_;
+  }
+}
+
+void geometry_store_t::sync_instances(const scene_t &scene, bool same_scene) {
+  const bool same_topology = same_scene &&
+                             instances_.size() == scene.instances.size() &&
+                             prototypes_.size() == scene.prototypes.size();
+  if (same_topology && instance_revision_ == scene.instance_revision()) {
+    return;
+  }
+
+  changed_.clear();
+  const bool replayed =
+      same_topology &&
+      scene.for_each_instance_change(instance_revision_, [this](size_t index) {
+        changed_.push_back(index);
+      });
+  instance_revision_ = scene.instance_revision();
+
+  if (!replayed) {
+    rebuild_instances(scene, same_scene);
+    return;
+  }
+
+  std::sort(changed_.begin(), changed_.end());
+  changed_.erase(std::unique(changed_.begin(), changed_.end()),
+                 changed_.end());
+  for (const size_t index : changed_) {
+    update_instance(scene, index);
+  }
+
+  instance_bvh_.refit(instance_bounds_, changed_);
+  if (instance_bvh_.degradation() > max_bvh_degradation) {
+    instance_bvh_.build(instance_bounds_);
+    ++rebuilds_;
+  }
+}
+
+} // namespace soft_render
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <soft-render/bvh.hpp>
+#include <soft-render/geometry.hpp>
+#include <soft-render/scene.hpp>
+
+namespace soft_render {
+
+/// Geometry of a prototype_t with its own BVH, in the prototype's space.
+struct prototype_geometry_t {
+  std::vector<sphere_geometry_t> spheres;
+  bvh_t bvh;
+  /// Of all the spheres.
+  aabb_t bounds;
+
+  explicit prototype_geometry_t(const prototype_t &prototype);
+};
+
+/**
+ * An instance_t as the tracer sees it. A ray is moved to the prototype's space
+ * and traced through the prototype's BVH there, so the prototype's geometry is
+ * never copied.
+ */
+struct instance_geometry_t {
+  /// World to the prototype's space.
+  glm::mat4 to_local = glm::mat4(1.0f);
+  uint32_t prototype = 0;
+
+  instance_geometry_t() = default;
+  explicit instance_geometry_t(const instance_t &instance) noexcept
+      : to_local(glm::inverse(instance.transform)),
+        prototype(instance.prototype) {}
+
+  /// Directions aren't normalized, so a hit has the same t in both spaces.
+  [[nodiscard]] ray_t ray_to_local(const ray_t &ray) const noexcept {
+    return {point_to_local(ray.origin),
+            glm::vec3(to_local * glm::vec4(ray.direction, 0.0f))};
+  }
+
+  [[nodiscard]] glm::vec3 point_to_local(glm::vec3 point) const noexcept {
+    return glm::vec3(to_local * glm::vec4(point, 1.0f));
+  }
+
+  /// Normals go back by the inverse transpose of the transform, that is the
+  /// transpose of to_local.
+  [[nodiscard]] glm::vec3 normal_to_world(glm::vec3 normal) const noexcept {
+    return glm::normalize(glm::vec3(glm::dot(glm::vec3(to_local[0]), normal),
+                                    glm::dot(glm::vec3(to_local[1]), normal),
+                                    glm::dot(glm::vec3(to_local[2]), normal)));
+  }
+};
+
+/**
+ * Geometry of scene_t::objects in the same order, so an index into the store
+ * is an index into the scene, plus the acceleration structure over it.
+ *
+ * The store lives across frames and follows the scene incrementally: sync()
+ * updates only the objects changed since the last sync and refits the BVH, so
+ * the per-frame cost is proportional to the number of changed objects.
+ *
+ * Instances make a two-level hierarchy: a BVH over the instances' world
+ * bounds on top, a BVH per prototype below. Moving an instance refits the top
+ * level only; geometry memory is proportional to the unique prototypes.
+ */
+class geometry_store_t {
+public:
+  /// Refitted BVH is rebuilt once its SAH cost grows that much.
+  static constexpr float max_bvh_degradation = 1.5f;
+
+  geometry_store_t() = default;
+  explicit geometry_store_t(const scene_t &scene) { sync(scene); }
+
+  /**
+   * Brings the store up to date with the scene. A different scene, a topology
+   * change or a change log that doesn't reach back far enough mean a rebuild.
+   */
+  void sync(const scene_t &scene);
+
+  /// Drops the tracking state, the next sync() rebuilds everything.
+  void invalidate() noexcept { generation_ = 0; }
+
+  [[nodiscard]] const std::vector<sphere_geometry_t> &spheres() const noexcept {
+    return spheres_;
+  }
+  [[nodiscard]] const bvh_t &bvh() const noexcept { return bvh_; }
+
+  /// In the order of scene_t::prototypes.
+  [[nodiscard]] const std::vector<prototype_geometry_t> &
+  prototypes() const noexcept {
+    return prototypes_;
+  }
+  /// In the order of scene_t::instances.
+  [[nodiscard]] const std::vector<instance_geometry_t> &
+  instances() const noexcept {
+    return instances_;
+  }
+  /// The top level, over the world bounds of the instances.
+  [[nodiscard]] const bvh_t &instance_bvh() const noexcept {
+    return instance_bvh_;
+  }
+
+  /// @return the unit normal at the hit point.
+  [[nodiscard]] glm::vec3 normal_at(const hit_t &hit,
+                                    glm::vec3 point) const noexcept {
+    if (hit.instance == hit_t::no_instance) {
+      return spheres_[hit.object].normal_at(point);
+    }
+    const instance_geometry_t &instance = instances_[hit.instance];
+    const sphere_geometry_t &sphere =
+        prototypes_[instance.prototype].spheres[hit.object];
+    return instance.normal_to_world(
+        sphere.normal_at(instance.point_to_local(point)));
+  }
+
+  /// Full rebuilds of either level done so far, refits don't count.
+  [[nodiscard]] size_t rebuilds() const noexcept { return rebuilds_; }
+
+private:
+  void sync_objects(const scene_t &scene, bool same_scene);
+  void sync_instances(const scene_t &scene, bool same_scene);
+  void rebuild(const scene_t &scene);
+  void rebuild_instances(const scene_t &scene, bool same_scene);
+  void update_instance(const scene_t &scene, size_t index);
+
+  std::vector<sphere_geometry_t> spheres_;
+  bvh_t bvh_;
+
+  std::vector<prototype_geometry_t> prototypes_;
+  std::vector<instance_geometry_t> instances_;
+  /// World bounds of the instances, the top level is built over them.
+  std::vector<aabb_t> instance_bounds_;
+  bvh_t instance_bvh_;
+
+  /// scene_t::generation() of the synced scene, 0 for none.
+  uint64_t generation_ = 0;
+  uint64_t revision_ = 0;
+  uint64_t instance_revision_ = 0;
+  size_t rebuilds_ = 0;
+  std::vector<size_t> changed_;
+};
+
+/**
+ * Closest hit among the spheres: updates `hit` and shrinks `t_max` to it.
+ *
+ * @param instance - the hit's instance if the spheres are a prototype's.
+ */
+inline void closest_sphere_hit(std::span<const sphere_geometry_t> spheres,
+                               const bvh_t &bvh, const ray_t &ray, float t_min,
+                               float &t_max, hit_t &hit,
+                               uint32_t instance) noexcept {
+  bvh.traverse(ray, t_min, t_max, [&](size_t i) {
+    const auto [t1, t2] = intersect_ray_sphere(ray, spheres[i]);
+    if (t1 <= t_max && t1 >= t_min && t1 < hit.t) {
+      hit = {.object = i, .t = t1, .instance = instance};
+    }
+    if (t2 <= t_max && t2 >= t_min && t2 < hit.t) {
+      hit = {.object = i, .t = t2, .instance = instance};
+    }
+    // Nothing further than the closest hit is interesting anymore.
+    t_max = std::min(t_max, hit.t);
+    return false;
+  });
+}
+
+/// closest_sphere_hit() over the instances, through the two-level hierarchy.
+inline void closest_instance_hit(const geometry_store_t &store,
+                                 const ray_t &ray, float t_min, float &t_max,
+                                 hit_t &hit) noexcept {
+  const auto &instances = store.instances();
+  const auto &prototypes = store.prototypes();
+  store.instance_bvh().traverse(ray, t_min, t_max, [&](size_t i) {
+    const instance_geometry_t &instance = instances[i];
+    const prototype_geometry_t &prototype = prototypes[instance.prototype];
+    closest_sphere_hit(prototype.spheres, prototype.bvh,
+                       instance.ray_to_local(ray), t_min, t_max, hit,
+                       static_cast<uint32_t>(i));
+    return false;
+  });
+}
+
+[[nodiscard]] inline hit_t closest_intersection(const geometry_store_t &store,
+                                                const ray_t &ray, float t_min,
+                                                float t_max) noexcept {
+  hit_t hit;
+  closest_sphere_hit(store.spheres(), store.bvh(), ray, t_min, t_max, hit,
+                     hit_t::no_instance);
+  closest_instance_hit(store, ray, t_min, t_max, hit);
+  return hit;
+}
+
+/// @return true if any of the spheres blocks the ray within [t_min, t_max].
+[[nodiscard]] inline bool any_sphere_hit(
+    std::span<const sphere_geometry_t> spheres, const bvh_t &bvh,
+    const ray_t &ray, float t_min, float t_max) noexcept {
+  // A miss is reported as infinity, it must not pass for t_max == infinity.
+  const auto in_range = [t_min, t_max](float t) {
+    return t <= t_max && t >= t_min &&
+           t < std::numeric_limits<float>::infinity();
+  };
+  bool blocked = false;
+  bvh.traverse(ray, t_min, t_max, [&](size_t i) {
+    const auto [t1, t2] = intersect_ray_sphere(ray, spheres[i]);
+    blocked = in_range(t1) || in_range(t2);
+    return blocked;
+  });
+  return blocked;
+}
+
+/**
+ * Any-hit query for shadow rays: it stops on the first blocker because we don't
+ * care which object casts the shadow.
+ */
+[[nodiscard]] inline bool occluded(const geometry_store_t &store,
+                                   const ray_t &ray, float t_min,
+                                   float t_max) noexcept {
+  if (any_sphere_hit(store.spheres(), store.bvh(), ray, t_min, t_max)) {
+    return true;
+  }
+  const auto &instances = store.instances();
+  const auto &prototypes = store.prototypes();
+  bool blocked = false;
+  store.instance_bvh().traverse(ray, t_min, t_max, [&](size_t i) {
+    const instance_geometry_t &instance = instances[i];
+    const prototype_geometry_t &prototype = prototypes[instance.prototype];
+    blocked = any_sphere_hit(prototype.spheres, prototype.bvh,
+                             instance.ray_to_local(ray), t_min, t_max);
+    return blocked;
+  });
+  return blocked;
+}
+
+} // namespace soft_render
@@ -0,0 +1,469 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <soft-render/fast_math.hpp>
+#include <soft-render/geometry.hpp>
+#include <soft-render/geometry_store.hpp>
+#include <soft-render/light_grid.hpp>
+#include <soft-render/mfb_color.hpp>
+#include <soft-render/render.hpp>
+#include <soft-render/scene.hpp>
+#include <soft-render/tile_bins.hpp>
+#include <soft-render/visibility_cache.hpp>
+
+// Per-frame data and shading shared by the tracing kernels (render.cpp and
+// wavefront.cpp). Not a part of the public interface.
+
+namespace soft_render {
+
+/**
+ * Lights of a scene split by kind, so the kernel doesn't visit a variant for
+ * every shaded point. Ambient lights don't depend on the point at all and are
+ * folded into a single intensity. Point lights with a range go to a grid, a
+ * point visits only the ones around it.
+ *
+ * The kernels sum the lights by kind: ambient, point, bounded, directional,
+ * each kind in the scene order. A scene that lists its lights in another order
+ * may differ in the last bits of the intensity from a sum in the scene order.
+ */
+struct light_table_t {
+  float ambient = 0.0f;
+  std::vector<directional_light_t> directional;
+  /// Point lights without a range, they reach everything.
+  std::vector<point_light_t> point;
+  std::vector<point_light_t> bounded;
+  /// Over `bounded`.
+  light_grid_t grid;
+
+  explicit light_table_t(const scene_t &scene) {
+    for (const auto &light : scene.lights) {
+      std::visit(
+          [this](const auto &light) {
+            using light_t = std::decay_t<decltype(light)>;
+            if constexpr (std::is_same_v<light_t, ambient_light_t>) {
+              ambient += light.intensity;
+            } else if constexpr (std::is_same_v<light_t,
+                                                 directional_light_t>) {
+              directional.push_back(light);
+            } else if constexpr (std::is_same_v<light_t, point_light_t>) {
+              (light.bounded() ? bounded : point).push_back(light);
+            } else {
+              static_assert("looks like we don't handle some sort of light");
+            }
+          },
+          light);
+    }
+    grid.build(bounded);
+  }
+};
+
+/**
+ * Materials of everything a ray may hit in one array, so a hit resolves to its
+ * material the same way whatever it hit: the scene objects come first, then
+ * the spheres of every prototype, then the instance overrides. Instances
+ * without an override share their prototype's entries.
+ */
+struct material_table_t {
+  /// The material of sphere s of an instance is first + s * stride.
+  struct instance_materials_t {
+    uint32_t first = 0;
+    /// 0 for an override, it's the same for every sphere.
+    uint32_t stride = 1;
+  };
+
+  std::vector<material_t> materials;
+  std::vector<instance_materials_t> instances;
+  /// Highlights of the fast math, one per distinct specular exponent.
+  std::vector<highlight_table_t> highlight_tables;
+  /// Per material, an index in highlight_tables or no_highlight.
+  std::vector<uint32_t> highlights;
+
+  static constexpr uint32_t no_highlight = ~uint32_t{0};
+  static constexpr uint32_t no_object = ~uint32_t{0};
+
+  /// The first entries, one per scene object.
+  uint32_t objects = 0;
+
+  explicit material_table_t(const scene_t &scene)
+      : objects(static_cast<uint32_t>(scene.objects.size())) {
+    materials.reserve(scene.objects.size());
+    for (const auto &object : scene.objects) {
+      materials.push_back(material_t::of(object));
+    }
+    std::vector<uint32_t> prototype_first;
+    prototype_first.reserve(scene.prototypes.size());
+    for (const auto &prototype : scene.prototypes) {
+      prototype_first.push_back(static_cast<uint32_t>(materials.size()));
+      for (const auto &object : prototype.objects) {
+        materials.push_back(material_t::of(object));
+      }
+    }
+    instances.reserve(scene.instances.size());
+    for (const auto &instance : scene.instances) {
+      if (instance.material) {
+        instances.push_back(
+            {.first = static_cast<uint32_t>(materials.size()), .stride = 0});
+        materials.push_back(*instance.material);
+      } else {
+        instances.push_back(
+            {.first = prototype_first[instance.prototype], .stride = 1});
+      }
+    }
+
+    // Scenes use a handful of exponents, a linear search is enough.
+    highlights.reserve(materials.size());
+    for (const auto &material : materials) {
+      if (material.specular <= -1.0f) {
+        highlights.push_back(no_highlight);
+        continue;
+      }
+      const auto same = std::ranges::find(highlight_tables, material.specular,
+                                          &highlight_table_t::exponent);
+      highlights.push_back(
+          static_cast<uint32_t>(same - highlight_tables.begin()));
+      if (same == highlight_tables.end()) {
+        highlight_tables.emplace_back(material.specular);
+      }
+    }
+  }
+
+  /// @return the index of the material of the hit.
+  [[nodiscard]] uint32_t id(const hit_t &hit) const noexcept {
+    if (hit.instance == hit_t::no_instance) {
+      return static_cast<uint32_t>(hit.object);
+    }
+    const instance_materials_t &instance = instances[hit.instance];
+    return instance.first + static_cast<uint32_t>(hit.object) * instance.stride;
+  }
+
+  [[nodiscard]] const material_t &of(const hit_t &hit) const noexcept {
+    return materials[id(hit)];
+  }
+
+  /**
+   * @return the scene object of the material, no_object for the spheres of
+   * prototypes and instance overrides.
+   */
+  [[nodiscard]] uint32_t object(uint32_t material) const noexcept {
+    return material < objects ? material : no_object;
+  }
+
+  /// @return the fast math highlight of the material, nullptr if it has none.
+  [[nodiscard]] const highlight_table_t *
+  highlight(uint32_t material) const noexcept {
+    const uint32_t table = highlights[material];
+    return table == no_highlight ? nullptr : &highlight_tables[table];
+  }
+};
+
+/**
+ * Everything the kernel needs from a scene for one frame. It's built once per
+ * render1() call and is read-only afterwards, so worker threads share it.
+ */
+struct prepared_scene_t {
+  const scene_t &scene;
+  light_table_t lights;
+  material_table_t materials;
+  /// Persistent, synced with the scene before the frame starts.
+  const geometry_store_t &geometry;
+  /// Shadows traced in advance, nullptr if every shadow ray is traced.
+  const visibility_cache_t *visibility = nullptr;
+
+  prepared_scene_t(const scene_t &scene, const geometry_store_t &geometry)
+      : scene(scene), lights(scene), materials(scene), geometry(geometry) {}
+};
+
+// light ray from the light point to the object!
+inline float calculate_diffuse_light(glm::vec3 normal, glm::vec3 light_ray,
+                                     float intencity) noexcept {
+  // In general, the intencity changes by cos(angle of the light).
+  // cos(two vectors) == dot product of two normalized vectors.
+  return intencity * glm::dot(normal, glm::normalize(light_ray));
+}
+
+/**
+ * @param point_to_camera - "view vector" from a point to a camera. previoulsy
+ * we traced the reversed vector.
+ *
+ * @return specular coefficient of additional intencity for the ray.
+ */
+inline float calculate_specular_light(glm::vec3 point_to_camera,
+                                      glm::vec3 normal, glm::vec3 light_ray,
+                                      float specular) {
+  if (specular <= -1.0f)
+    return 0.0f;
+  // The picture looks like V (but the light ray in our case goes from the
+  // object). The light ray reflects with the same angle for a normal. Light ray
+  // projection:
+  // * to normal = normal * <normal, light_ray>
+  // * to object = light_ray - normal * <normal, light_ray>
+  // reflected ray is a sum of those two rays.
+  const auto reflected_ray =
+      normal * glm::dot(normal, light_ray) * 2.0f - light_ray;
+  const float r_dot_v = dot(reflected_ray, point_to_camera);
+  if (r_dot_v > 0) {
+    return std::pow(r_dot_v / (length(reflected_ray) * length(point_to_camera)),
+                    specular);
+  }
+  // it's not reflected. do nothing with intencity.
+  return 0.0f;
+}
+
+/**
+ * A light whose contribution to a point is below this is skipped, with its
+ * shadow ray. It's a quarter of an 8-bit color step.
+ */
+inline constexpr float min_light_contribution = 1.0f / 1024.0f;
+
+/**
+ * @return diffuse and specular intensity the light adds to the point if
+ * nothing blocks it.
+ *
+ * With fast math `point_to_camera` must be normalized: it's done once per
+ * point, not once per light. The highlight comes from `highlight`, `specular`
+ * is only used by the exact math.
+ */
+template <trace_features_t Features>
+float light_contribution(glm::vec3 normal, glm::vec3 light_ray,
+                         glm::vec3 point_to_camera, float light_intensity,
+                         float specular, const highlight_table_t *highlight) {
+  if constexpr (Features.fast_math) {
+    // With both the normal and the light ray unit, the reflected ray is unit
+    // too: the only length left is the light ray's, and it's an rsqrt.
+    const float inv_length = fast_rsqrt(glm::dot(light_ray, light_ray));
+    const float n_dot_l = glm::dot(normal, light_ray) * inv_length;
+    float contribution = std::max(light_intensity * n_dot_l, 0.0f);
+    if constexpr (Features.specular) {
+      if (highlight != nullptr) {
+        const glm::vec3 reflected_ray =
+            normal * (2.0f * n_dot_l) - light_ray * inv_length;
+        // The table is 0 for reflections that point away from the camera.
+        contribution += light_intensity *
+                        (*highlight)(glm::dot(reflected_ray, point_to_camera));
+      }
+    }
+    return contribution;
+  } else {
+    float contribution = std::max(
+        calculate_diffuse_light(normal, light_ray, light_intensity), 0.0f);
+    if constexpr (Features.specular) {
+      contribution +=
+          light_intensity * calculate_specular_light(point_to_camera, normal,
+                                                     light_ray, specular);
+    }
+    return contribution;
+  }
+}
+
+/**
+ * @return true if something blocks the light of the point: looked up in the
+ * visibility cache if there is one and it knows, traced otherwise.
+ *
+ * @param material - of the point, the cache covers the scene objects.
+ * @param light - the light's number, see visibility_cache_t.
+ */
+[[nodiscard]] inline bool shadowed(const prepared_scene_t &prepared,
+                                   uint32_t material, size_t light,
+                                   glm::vec3 point, glm::vec3 normal,
+                                   glm::vec3 light_ray, float t_max) noexcept {
+  const ray_t ray(point, light_ray);
+  const uint32_t object = prepared.materials.object(material);
+  if (prepared.visibility != nullptr &&
+      object != material_table_t::no_object) {
+    // The same test any_sphere_hit() does, for a single sphere.
+    const auto blocks = [&](uint32_t sphere) {
+      const auto [t1, t2] =
+          intersect_ray_sphere(ray, prepared.geometry.spheres()[sphere]);
+      for (const float t : {t1, t2}) {
+        if (t <= t_max && t >= 0.001f &&
+            t < std::numeric_limits<float>::infinity()) {
+          return true;
+        }
+      }
+      return false;
+    };
+    using visibility_t = visibility_cache_t::visibility_t;
+    switch (prepared.visibility->lookup(object, light, normal, light_ray)) {
+    case visibility_t::lit:
+      // A point a bit inside its sphere may shadow itself, a traced ray
+      // would see that too.
+      return blocks(object);
+    case visibility_t::occluded:
+      return true;
+    case visibility_t::lit_unless_moved:
+      return blocks(object) ||
+             std::ranges::any_of(prepared.visibility->moved(), blocks);
+    case visibility_t::unknown:
+      break;
+    }
+  }
+  return occluded(prepared.geometry, ray, 0.001f, t_max);
+}
+
+/**
+ * @return intensity [0.0f, 1.0f] calculated by available light sources.
+ */
+template <trace_features_t Features>
+float compute_lightning(glm::vec3 point, glm::vec3 normal,
+                        const prepared_scene_t &prepared,
+                        glm::vec3 point_to_camera, uint32_t material) {
+  // It's reflected light, so we don't care about phisics and assume that all
+  // objects emit a bit of light.
+  float intensity = prepared.lights.ambient;
+  if constexpr (Features.fast_math) {
+    point_to_camera = fast_normalize(point_to_camera);
+  }
+  const float specular = prepared.materials.materials[material].specular;
+  const highlight_table_t *highlight = prepared.materials.highlight(material);
+
+  const auto add_light = [&](size_t light, glm::vec3 light_ray,
+                             float light_intensity, float attenuation,
+                             float t_max) {
+    const float contribution =
+        light_contribution<Features>(normal, light_ray, point_to_camera,
+                                     light_intensity, specular, highlight) *
+        attenuation;
+    // Too dim to matter (or facing away), don't pay for the shadow ray.
+    if (contribution < min_light_contribution) {
+      return;
+    }
+
+    if constexpr (Features.shadows) {
+      // Shadow check
+      if (shadowed(prepared, material, light, point, normal, light_ray,
+                   t_max)) {
+        return;
+      }
+    }
+    intensity += contribution;
+  };
+
+  // Lights are numbered like the visibility cache does: point, bounded,
+  // directional. It's the summation order too, see light_table_t.
+  const auto &lights = prepared.lights;
+  for (size_t i = 0; i < lights.point.size(); ++i) {
+    // Once again, the light goes from the light position to the object.
+    const point_light_t &light = lights.point[i];
+    add_light(i, light.position - point, light.intensity, 1.0f, 1.0f);
+  }
+  for (const uint32_t index : lights.grid.lights_at(point)) {
+    const point_light_t &light = lights.bounded[index];
+    const glm::vec3 light_ray = light.position - point;
+    add_light(lights.point.size() + index, light_ray, light.intensity,
+              light.attenuation(glm::dot(light_ray, light_ray)), 1.0f);
+  }
+  const size_t first_directional = lights.point.size() + lights.bounded.size();
+  for (size_t i = 0; i < lights.directional.size(); ++i) {
+    // Directional light goes always to one direction.
+    const directional_light_t &light = lights.directional[i];
+    add_light(first_directional + i, light.direction, light.intensity, 1.0f,
+              std::numeric_limits<float>::infinity());
+  }
+  return std::min(intensity, 1.0f);
+}
+
+/**
+ * @return the same point on a projection plane
+ * @param canvas - current canvas coordinates (pixels)
+ */
+[[nodiscard]] inline glm::vec3
+canvas_to_viewport(glm::vec2 canvas, canvas_size_t canvas_size,
+                   viewport_size_t viewport_size) noexcept {
+  return {// simply scale the coordinate by canvas sizes
+          canvas.x * viewport_size.width / canvas_size.width.as_float(),
+          canvas.y * viewport_size.height / canvas_size.height.as_float(),
+          // z component is a constant because it's a property of the viewport
+          viewport_size.distance};
+}
+
+/**
+ * Per-frame camera constants. Both the canvas to viewport mapping and the
+ * rotation are linear, so a primary ray for the pixel (i, j) is
+ * top_left + i * step_x + j * step_y. It replaces two divisions and a 4x4
+ * matrix multiply per pixel.
+ */
+struct camera_setup_t {
+  glm::vec3 origin;
+  /// The ray through the left-top pixel of the canvas.
+  glm::vec3 top_left;
+  /// Ray increments for one pixel to the right and one pixel down.
+  glm::vec3 step_x;
+  glm::vec3 step_y;
+
+  camera_setup_t(const canvas_size_t &canvas_size,
+                 const viewport_size_t &viewport_size) noexcept
+      : origin(viewport_size.position) {
+    /*
+     * Canvas coordinates goes from left-top corner (x goes right, y goes
+     * down). The projection plane has (0,0) in the center and y goes up.
+     */
+    const auto left = -(canvas_size.width.as_ssize() / 2);
+    const auto top = canvas_size.height.as_ssize() / 2;
+    const glm::vec3 corner = canvas_to_viewport(
+        glm::vec2(static_cast<float>(left), static_cast<float>(top)),
+        canvas_size, viewport_size);
+
+    top_left = viewport_size.rotation_matrix * glm::vec4(corner, 1.0f);
+    // Steps are directions, so they don't pick up any translation.
+    step_x = viewport_size.rotation_matrix *
+             glm::vec4(viewport_size.width / canvas_size.width.as_float(),
+                       0.0f, 0.0f, 0.0f);
+    step_y = viewport_size.rotation_matrix *
+             glm::vec4(0.0f,
+                       -viewport_size.height / canvas_size.height.as_float(),
+                       0.0f, 0.0f);
+  }
+
+  [[nodiscard]] inline glm::vec3 ray(size_t i, size_t j) const noexcept {
+    return top_left + step_x * static_cast<float>(i) +
+           step_y * static_cast<float>(j);
+  }
+};
+
+inline glm::vec3 reflect_ray(glm::vec3 ray, glm::vec3 normal) noexcept {
+  return 2.0f * normal * glm::dot(normal, ray) - ray;
+}
+
+/**
+ * Traces the pixels of canvas row j from column i, one per element of the
+ * span (the last argument).
+ */
+using row_kernel_t = void (*)(const prepared_scene_t &, const camera_setup_t &,
+                              const tile_bins_t &, size_t i, size_t j,
+                              std::span<mfb_color>);
+
+/**
+ * Kernels are indexed by (depth, shadows, specular). Reflections are implied by
+ * a non-zero depth, so there is no separate "reflections with zero bounces"
+ * variant.
+ */
+constexpr size_t kernel_index(trace_features_t features) noexcept {
+  const int depth = features.reflections ? features.max_depth : 0;
+  return static_cast<size_t>(depth) * 8 + (features.shadows ? 4 : 0) +
+         (features.specular ? 2 : 0) + (features.fast_math ? 1 : 0);
+}
+
+constexpr trace_features_t kernel_features(size_t index) noexcept {
+  const int depth = static_cast<int>(index / 8);
+  return {.max_depth = depth,
+          .shadows = (index / 4) % 2 != 0,
+          .specular = (index / 2) % 2 != 0,
+          .reflections = depth > 0,
+          .fast_math = index % 2 != 0};
+}
+
+/// Number of kernel variants, one per kernel_index().
+inline constexpr size_t kernel_count = (max_trace_depth + 1) * 8;
+
+} // namespace soft_render
@@ -0,0 +1,84 @@
+#include "light_grid.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+namespace soft_render {
+
+void light_grid_t::build(std::span<const point_light_t> lights) {
+  bounds_ = {};
+  lights_.clear();
+  offsets_.clear();
+  if (lights.empty()) {
+    dims_ = {0, 0, 0};
+    return;
+  }
+
+  float total_range = 0.0f;
+  for (const auto &light : lights) {
+    bounds_.grow(aabb_t{light.position - light.range,
+                        light.position + light.range});
+    total_range += light.range;
+  }
+  const glm::vec3 extent = bounds_.extent();
+  // No finer than the cells per axis allow, nor zero for zero ranges.
+  const float cell_size =
+      std::max({total_range / static_cast<float>(lights.size()),
+                std::max({extent.x, extent.y, extent.z}) /
+                    static_cast<float>(max_cells_per_axis),
+                std::numeric_limits<float>::min()});
+  for (glm::length_t axis = 0; axis < 3; ++axis) {
+    const auto dim = static_cast<size_t>(std::ceil(extent[axis] / cell_size));
+    dims_[axis] = std::clamp<size_t>(dim, 1, max_cells_per_axis);
+    inv_cell_size_[axis] =
+        extent[axis] > 0.0f ? static_cast<float>(dims_[axis]) / extent[axis]
+                            : 0.0f;
+  }
+
+  // Cells a light reaches, [first, last] inclusive per axis.
+  const auto cells_of = [this](const point_light_t &light) {
+    std::array<std::pair<size_t, size_t>, 3> cells;
+    for (glm::length_t axis = 0; axis < 3; ++axis) {
+      const auto cell = [&](float x) {
+        const float c = (x - bounds_.min[axis]) * inv_cell_size_[axis];
+        return std::min(static_cast<size_t>(std::max(c, 0.0f)),
+                        dims_[axis] - 1);
+      };
+      cells[axis] = {cell(light.position[axis] - light.range),
+                     cell(light.position[axis] + light.range)};
+    }
+    return cells;
+  };
+  const auto for_each_cell = [this, &cells_of](const point_light_t &light,
+                                               auto &&f) {
+    const auto cells = cells_of(light);
+    for (size_t z = cells[2].first; z <= cells[2].second; ++z) {
+      for (size_t y = cells[1].first; y <= cells[1].second; ++y) {
+        for (size_t x = cells[0].first; x <= cells[0].second; ++x) {
+          f((z * dims_[1] + y) * dims_[0] + x);
+        }
+      }
+    }
+  };
+
+  // Counts to offsets, then fill the lists in the light order.
+  const size_t cells = dims_[0] * dims_[1] * dims_[2];
+  offsets_.assign(cells + 1, 0);
+  for (const auto &light : lights) {
+    for_each_cell(light, [this](size_t cell) { ++offsets_[cell + 1]; });
+  }
+  for (size_t cell = 0; cell < cells; ++cell) {
+    offsets_[cell + 1] += offsets_[cell];
+  }
+  lights_.resize(offsets_[cells]);
+  next_.assign(offsets_.begin(), offsets_.end() - 1);
+  for (size_t i = 0; i < lights.size(); ++i) {
+    for_each_cell(lights[i], [this, i](size_t cell) {
+      lights_[next_[cell]++] = static_cast<uint32_t>(i);
+    });
+  }
+}
+
+} // namespace soft_render
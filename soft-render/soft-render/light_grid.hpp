@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <soft-render/bvh.hpp>
+#include <soft-render/scene.hpp>
+
+namespace soft_render {
+
+/**
+ * Uniform grid over bounded point lights, built per frame. Every cell lists
+ * the lights whose range reaches into it, so shading visits the lights near
+ * a point instead of all of them.
+ *
+ * Cells are about a light range wide, so a light lands in a few cells and a
+ * point sees roughly the lights around it.
+ */
+class light_grid_t {
+public:
+  static constexpr size_t max_cells_per_axis = 32;
+
+  /// All `lights` must be bounded(), with a positive range.
+  void build(std::span<const point_light_t> lights);
+
+  /**
+   * @return indices (into the `lights` of build()) of the lights that may
+   * reach the point, in increasing order. The list is conservative, a light
+   * in it may still be out of range.
+   */
+  [[nodiscard]] std::span<const uint32_t>
+  lights_at(glm::vec3 point) const noexcept {
+    if (lights_.empty()) {
+      return {};
+    }
+    std::array<size_t, 3> cell;
+    for (glm::length_t axis = 0; axis < 3; ++axis) {
+      const float x = (point[axis] - bounds_.min[axis]) * inv_cell_size_[axis];
+      // Negated, so NaN is outside too.
+      if (!(x >= 0.0f && x < static_cast<float>(dims_[axis]))) {
+        return {};
+      }
+      cell[axis] = static_cast<size_t>(x);
+    }
+    const size_t index = (cell[2] * dims_[1] + cell[1]) * dims_[0] + cell[0];
+    return std::span(lights_).subspan(offsets_[index],
+                                      offsets_[index + 1] - offsets_[index]);
+  }
+
+  [[nodiscard]] const aabb_t &bounds() const noexcept { return bounds_; }
+
+private:
+  aabb_t bounds_;
+  glm::vec3 inv_cell_size_ = glm::vec3(0.0f);
+  std::array<size_t, 3> dims_ = {0, 0, 0};
+  /// Cell -> the first entry of its list in lights_, cells + 1 entries.
+  std::vector<uint32_t> offsets_;
+  std::vector<uint32_t> lights_;
+  /// Scratch: the next free entry of every cell list.
+  std::vector<uint32_t> next_;
+};
+
+} // namespace soft_render
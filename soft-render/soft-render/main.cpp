@@ -1,6 +1,12 @@
 #include <cassert>
+#include <algorithm>
+#include <array>
+#include <charconv>
 #include <chrono>
+#include <cstdio>
 #include <iostream>
+#include <optional>
+#include <string_view>
 #include <vector>
 
 #include <MiniFB_cpp.h>
@@ -9,7 +15,9 @@
 #include <glm/gtx/transform.hpp>
 #include <glm/trigonometric.hpp>
 
+#include "output.hpp"
 #include "render.hpp"
+#include "worker_topology.hpp"
 
 using namespace soft_render;
 
@@ -61,14 +69,173 @@ struct movement_controller {
 
     return angles;
   }
+
+  /// @return true if a movement that was off `before` is on now.
+  [[nodiscard]] bool
+  started(const movement_controller &before) const noexcept {
+    const auto flags = [](const movement_controller &m) {
+      return std::array{m.forward,   m.left,        m.right,
+                        m.backward,  m.up,          m.down,
+                        m.rotate_up, m.rotate_down, m.rotate_left,
+                        m.rotate_right};
+    };
+    const auto now = flags(*this);
+    const auto then = flags(before);
+    for (size_t i = 0; i < now.size(); ++i) {
+      if (now[i] && !then[i]) {
+        return true;
+      }
+    }
+    return false;
+  }
 };
 
-int main(int argc, char *argv[]) {
-  mfb_window *window = mfb_open("my_app", window_width, window_height);
-  if (!window)
-    return 0;
-  auto buffer =
-      std::vector<mfb_color>(window_width * window_height, mfb_color::red());
+/**
+ * Command line options:
+ *   --output <dest>    write every frame to `-` (stdout) or to files by a fmt
+ *                      pattern with the frame number, e.g. frame_{:05}.qoi
+ *   --format <name>    ppm (default), png, qoi or bgra
+ *   --frames <n>       render n frames without a window and exit
+ *   --pipeline <name>  megakernel (default) or wavefront
+ *   --math <name>      shading math: exact (default) or fast
+ *   --shadows <name>   shadow rays: traced (default) or cached
+ *   --tiles <order>    tile order: scanline (default) or morton
+ *   --layout <name>    frame buffer: linear (default) or tiled, detiled for
+ *                      the window and the output
+ *   --deadline <ms>    render the tiles nearest to the centre first and skip
+ *                      the ones that haven't started in time, they show the
+ *                      previous frame
+ *   --periphery <r>    render the tiles nearest to the centre first and the
+ *                      ones farther than r (in the window side) at half the
+ *                      rows
+ *   --workers <spec>   worker threads: auto (default, a NUMA node per socket),
+ *                      <n> threads or <nodes>x<n> simulated NUMA nodes
+ */
+struct options_t {
+  std::optional<frame_output_options_t> output;
+  size_t frames = 0;
+  render_pipeline_t pipeline = render_pipeline_t::megakernel;
+  shading_math_t math = shading_math_t::exact;
+  shadow_mode_t shadows = shadow_mode_t::traced;
+  tile_order_t tile_order = tile_order_t::scanline;
+  pixel_layout_t layout = pixel_layout_t::linear;
+  std::optional<render_priority_t> priority;
+  std::optional<worker_topology_t> workers;
+};
+
+[[nodiscard]] std::optional<options_t> parse_options(int argc, char *argv[]) {
+  options_t options;
+  std::optional<image_format_t> format;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (i + 1 == argc) {
+      fmt::println(stderr, "error: missing value for {}", arg);
+      return std::nullopt;
+    }
+    const std::string_view value = argv[++i];
+
+    if (arg == "--output") {
+      options.output.emplace().destination = value;
+    } else if (arg == "--format") {
+      format = parse_image_format(value);
+      if (!format) {
+        fmt::println(stderr, "error: unknown format {}", value);
+        return std::nullopt;
+      }
+    } else if (arg == "--frames") {
+      const auto [end, ec] = std::from_chars(
+          value.data(), value.data() + value.size(), options.frames);
+      if (ec != std::errc() || end != value.data() + value.size()) {
+        fmt::println(stderr, "error: invalid number of frames {}", value);
+        return std::nullopt;
+      }
+    } else if (arg == "--pipeline") {
+      const auto pipeline = parse_render_pipeline(value);
+      if (!pipeline) {
+        fmt::println(stderr, "error: unknown pipeline {}", value);
+        return std::nullopt;
+      }
+      options.pipeline = *pipeline;
+    } else if (arg == "--math") {
+      const auto math = parse_shading_math(value);
+      if (!math) {
+        fmt::println(stderr, "error: unknown math {}", value);
+        return std::nullopt;
+      }
+      options.math = *math;
+    } else if (arg == "--shadows") {
+      const auto shadows = parse_shadow_mode(value);
+      if (!shadows) {
+        fmt::println(stderr, "error: unknown shadows {}", value);
+        return std::nullopt;
+      }
+      options.shadows = *shadows;
+    } else if (arg == "--tiles") {
+      const auto order = parse_tile_order(value);
+      if (!order) {
+        fmt::println(stderr, "error: unknown tile order {}", value);
+        return std::nullopt;
+      }
+      options.tile_order = *order;
+    } else if (arg == "--layout") {
+      const auto layout = parse_pixel_layout(value);
+      if (!layout) {
+        fmt::println(stderr, "error: unknown layout {}", value);
+        return std::nullopt;
+      }
+      options.layout = *layout;
+    } else if (arg == "--deadline") {
+      unsigned milliseconds = 0;
+      const auto [end, ec] = std::from_chars(
+          value.data(), value.data() + value.size(), milliseconds);
+      if (ec != std::errc() || end != value.data() + value.size()) {
+        fmt::println(stderr, "error: invalid deadline {}", value);
+        return std::nullopt;
+      }
+      if (!options.priority) {
+        options.priority.emplace();
+      }
+      options.priority->deadline = std::chrono::milliseconds(milliseconds);
+    } else if (arg == "--periphery") {
+      float radius = 0.0f;
+      const auto [end, ec] =
+          std::from_chars(value.data(), value.data() + value.size(), radius);
+      if (ec != std::errc() || end != value.data() + value.size() ||
+          radius < 0.0f) {
+        fmt::println(stderr, "error: invalid periphery {}", value);
+        return std::nullopt;
+      }
+      if (!options.priority) {
+        options.priority.emplace();
+      }
+      options.priority->full_radius = radius;
+    } else if (arg == "--workers") {
+      options.workers = parse_worker_topology(value);
+      if (!options.workers) {
+        fmt::println(stderr, "error: invalid workers {}", value);
+        return std::nullopt;
+      }
+    } else {
+      fmt::println(stderr, "error: unknown option {}", arg);
+      return std::nullopt;
+    }
+  }
+
+  if (format) {
+    if (!options.output) {
+      fmt::println(stderr, "error: --format requires --output");
+      return std::nullopt;
+    }
+    options.output->format = *format;
+  }
+  return options;
+}
+
+int main(int argc, char *argv[]) try {
+  const std::optional<options_t> options = parse_options(argc, argv);
+  if (!options)
+    return 1;
+
   std::vector<sphere_t> objects = {
 
       {.color = mfb_color::red(),
@@ -101,15 +268,77 @@ int main(int argc, char *argv[]) {
 
   scene_t scene = {.lights = lights, .objects = objects};
 
+  const canvas_size_t canvas_size = {
+      .width = pixel_coordinate_t(window_width),
+      .height = pixel_coordinate_t(window_height)};
+  std::optional<frame_output> output;
+  if (options->output) {
+    output.emplace(*options->output);
+  }
+
   movement_controller moves;
   viewport_size_t viewport;
   bool exit = false;
-  renderer main_renderer;
+  bool animate = false;
+  renderer main_renderer(
+      options->workers.value_or(worker_topology_t::detect()));
+  main_renderer.set_pipeline(options->pipeline);
+  main_renderer.set_math(options->math);
+  main_renderer.set_shadows(options->shadows);
+  main_renderer.set_tile_order(options->tile_order);
+  main_renderer.set_priority(options->priority);
+
+  framebuffer_t buffer = main_renderer.make_framebuffer(canvas_size);
+  std::fill_n(buffer.data(), buffer.size(), mfb_color::red());
+  // With the tiled layout frames go to `tiled` and are detiled to `buffer`.
+  framebuffer_t tiled;
+  if (options->layout == pixel_layout_t::tiled) {
+    tiled = main_renderer.make_framebuffer(canvas_size, pixel_layout_t::tiled);
+    std::fill_n(tiled.data(), tiled.size(), mfb_color::red());
+  }
+  const auto frame_view = [&] {
+    return tiled.size() != 0
+               ? render_view_t::tiled(tiled.pixels(), canvas_size, viewport)
+               : render_view_t::whole(buffer.pixels(), canvas_size, viewport);
+  };
+  const auto detile = [&] {
+    if (tiled.size() != 0) {
+      tiled_layout_t::of(canvas_size)
+          .detile(tiled.pixels(), buffer.pixels(), window_width);
+    }
+  };
+
+  if (options->frames != 0) {
+    // Batch mode: nobody waits for a particular frame, so use all the cores.
+    main_renderer.enable_mt();
+    for (size_t i = 0; i < options->frames; ++i) {
+      const render_view_t view = frame_view();
+      main_renderer.render(std::span(&view, 1), scene);
+      detile();
+      if (output) {
+        output->submit({buffer.data(), buffer.data() + buffer.size()},
+                       window_width, window_height);
+      }
+    }
+    if (output) {
+      output->flush();
+    }
+    return 0;
+  }
 
+  mfb_window *window = mfb_open("my_app", window_width, window_height);
+  if (!window)
+    return 0;
+
+  // A movement started since the current frame did: the camera won't stay
+  // where the frame shows it. Key repeats, releases and mode toggles leave the
+  // frame as good as the next one would be.
+  bool camera_moved = false;
   mfb_set_keyboard_callback(
-      [&moves, &exit,
+      [&moves, &exit, &animate, &camera_moved,
        &main_renderer]([[maybe_unused]] mfb_window *window, mfb_key key,
                        [[maybe_unused]] mfb_key_mod mod, bool is_pressed) {
+        const movement_controller before = moves;
         switch (key) {
         case mfb_key::KB_KEY_W:
           moves.forward = is_pressed;
@@ -146,6 +375,37 @@ int main(int argc, char *argv[]) {
           exit = true;
           break;
 
+        case mfb_key::KB_KEY_SPACE:
+          if (is_pressed)
+            animate = !animate;
+          break;
+
+        case mfb_key::KB_KEY_F1:
+          main_renderer.set_quality(render_quality_t::preview);
+          break;
+        case mfb_key::KB_KEY_F2:
+          main_renderer.set_quality(render_quality_t::draft);
+          break;
+        case mfb_key::KB_KEY_F3:
+          main_renderer.set_quality(render_quality_t::full);
+          break;
+
+        case mfb_key::KB_KEY_F4:
+          if (is_pressed) {
+            main_renderer.set_pipeline(
+                main_renderer.pipeline() == render_pipeline_t::megakernel
+                    ? render_pipeline_t::wavefront
+                    : render_pipeline_t::megakernel);
+          }
+          break;
+        case mfb_key::KB_KEY_F5:
+          if (is_pressed) {
+            main_renderer.set_math(main_renderer.math() == shading_math_t::exact
+                                       ? shading_math_t::fast
+                                       : shading_math_t::exact);
+          }
+          break;
+
         case mfb_key::KB_KEY_F12:
           main_renderer.enable_mt();
           break;
@@ -154,28 +414,65 @@ int main(int argc, char *argv[]) {
           // nothing to handle
           break;
         }
+        camera_moved = camera_moved || moves.started(before);
       },
       window);
 
   auto start = std::chrono::steady_clock::now();
   int frame_counter = 0;
+  unsigned animation_frame = 0;
   do {
+    if (animate) {
+      // Bounce the small spheres, only they are updated in the scene.
+      const float phase = glm::radians(static_cast<float>(animation_frame++));
+      for (size_t i = 0; i < 3; ++i) {
+        glm::vec3 position = objects[i].position;
+        position.y += 0.5f * glm::sin(4.0f * phase + static_cast<float>(i));
+        scene.set_position(i, position);
+      }
+    }
+
     // fmt::println("moves: w: {}, a: {}, s: {}, d: {}", moves.forward,
     // moves.left, moves.backward, moves.right);
     viewport.position = moves.apply(viewport.position);
     viewport.rotate(moves.rotate(viewport.rotation));
 
-    main_renderer.render1(buffer,
-                          {.width = pixel_coordinate_t(window_width),
-                           .height = pixel_coordinate_t(window_height)},
-                          viewport, scene);
+    // Keep handling input while the frame renders. Once it makes the frame
+    // stale, drop it and start over with the new camera.
+    const render_view_t view = frame_view();
+    render_job job = main_renderer.render_async(std::span(&view, 1), scene);
+    camera_moved = false;
+    while (!job.wait_for(std::chrono::milliseconds(2))) {
+      if (mfb_update_events(window) != STATE_OK) {
+        exit = true;
+      }
+      if (camera_moved || exit) {
+        job.cancel();
+        // Tiles in flight still write to the buffer.
+        job.wait();
+        break;
+      }
+    }
+    if (exit) {
+      break;
+    }
+    if (job.cancelled()) {
+      continue;
+    }
+    detile();
+
+    if (output) {
+      output->submit({buffer.data(), buffer.data() + buffer.size()},
+                     window_width, window_height);
+    }
     ++frame_counter;
 
     std::chrono::duration<double> frame =
         std::chrono::steady_clock::now() - start;
 
     if (frame.count() >= 1.0) {
-      fmt::println("fps: {}",
+      // stdout may carry the frames.
+      fmt::println(stderr, "fps: {}",
                    static_cast<double>(frame_counter) / frame.count());
       start = std::chrono::steady_clock::now();
       frame_counter = 0;
@@ -189,5 +486,11 @@ int main(int argc, char *argv[]) {
     }
   } while (mfb_wait_sync(window) && !exit);
 
+  if (output) {
+    output->flush();
+  }
   return 0;
+} catch (const std::exception &e) {
+  fmt::println(stderr, "error: {}", e.what());
+  return 1;
 }
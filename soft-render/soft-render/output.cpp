@@ -0,0 +1,380 @@
+#include "output.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+#include <boost/asio/post.hpp>
+#include <fmt/format.h>
+
+namespace soft_render {
+
+namespace {
+
+void put_u32_be(std::vector<uint8_t> &out, uint32_t value) {
+  out.push_back(static_cast<uint8_t>(value >> 24));
+  out.push_back(static_cast<uint8_t>(value >> 16));
+  out.push_back(static_cast<uint8_t>(value >> 8));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+std::vector<uint8_t> encode_ppm(std::span<const mfb_color> pixels,
+                                size_t width, size_t height) {
+  const std::string header = fmt::format("P6\n{} {}\n255\n", width, height);
+  std::vector<uint8_t> out(header.begin(), header.end());
+  out.reserve(header.size() + pixels.size() * 3);
+  for (const auto &pixel : pixels) {
+    out.push_back(pixel.r);
+    out.push_back(pixel.g);
+    out.push_back(pixel.b);
+  }
+  return out;
+}
+
+constexpr std::array<uint32_t, 256> crc32_table = [] {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t n = 0; n < table.size(); ++n) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; ++k) {
+      c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    }
+    table[n] = c;
+  }
+  return table;
+}();
+
+uint32_t crc32(std::span<const uint8_t> data,
+               uint32_t crc = 0xffffffffu) noexcept {
+  for (const auto byte : data) {
+    crc = crc32_table[(crc ^ byte) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+void put_png_chunk(std::vector<uint8_t> &out, const char (&type)[5],
+                   std::span<const uint8_t> data) {
+  put_u32_be(out, static_cast<uint32_t>(data.size()));
+  const size_t type_offset = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data.begin(), data.end());
+  put_u32_be(out, crc32({out.data() + type_offset, data.size() + 4}) ^
+                      0xffffffffu);
+}
+
+/**
+ * A zlib stream of "stored" deflate blocks: valid for every PNG decoder and
+ * encoded at memcpy speed. Compression is the job of whatever consumes the
+ * frames, we only must not slow the renderer down.
+ */
+std::vector<uint8_t> zlib_store(std::span<const uint8_t> data) {
+  constexpr size_t max_block = 0xffff;
+  std::vector<uint8_t> out;
+  out.reserve(data.size() + (data.size() / max_block + 1) * 5 + 6);
+  out.push_back(0x78);
+  out.push_back(0x01);
+
+  size_t offset = 0;
+  do {
+    const size_t size = std::min(max_block, data.size() - offset);
+    const bool last = offset + size == data.size();
+    out.push_back(last ? 1 : 0);
+    out.push_back(static_cast<uint8_t>(size));
+    out.push_back(static_cast<uint8_t>(size >> 8));
+    out.push_back(static_cast<uint8_t>(~size));
+    out.push_back(static_cast<uint8_t>(~size >> 8));
+    out.insert(out.end(), data.begin() + offset, data.begin() + offset + size);
+    offset += size;
+  } while (offset < data.size());
+
+  // Adler-32. 5552 is the largest run that can't overflow the sums.
+  uint32_t a = 1, b = 0;
+  for (size_t i = 0; i < data.size();) {
+    const size_t end = std::min(data.size(), i + 5552);
+    for (; i < end; ++i) {
+      a += data[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  put_u32_be(out, (b << 16) | a);
+  return out;
+}
+
+std::vector<uint8_t> encode_png(std::span<const mfb_color> pixels,
+                                size_t width, size_t height) {
+  // Every scanline starts with a filter type, 0 is "none".
+  std::vector<uint8_t> scanlines;
+  scanlines.reserve(height * (width * 3 + 1));
+  for (size_t y = 0; y < height; ++y) {
+    scanlines.push_back(0);
+    for (const auto &pixel : pixels.subspan(y * width, width)) {
+      scanlines.push_back(pixel.r);
+      scanlines.push_back(pixel.g);
+      scanlines.push_back(pixel.b);
+    }
+  }
+
+  std::vector<uint8_t> header;
+  put_u32_be(header, static_cast<uint32_t>(width));
+  put_u32_be(header, static_cast<uint32_t>(height));
+  // bit depth 8, color type 2 (RGB), default compression, filter, no interlace
+  header.insert(header.end(), {8, 2, 0, 0, 0});
+
+  std::vector<uint8_t> out = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  put_png_chunk(out, "IHDR", header);
+  put_png_chunk(out, "IDAT", zlib_store(scanlines));
+  put_png_chunk(out, "IEND", {});
+  return out;
+}
+
+/**
+ * See https://qoiformat.org/qoi-specification.pdf. Our alpha channel is unused,
+ * so it's a 3-channel image and every pixel is opaque.
+ */
+std::vector<uint8_t> encode_qoi(std::span<const mfb_color> pixels,
+                                size_t width, size_t height) {
+  constexpr uint8_t op_index = 0x00;
+  constexpr uint8_t op_diff = 0x40;
+  constexpr uint8_t op_luma = 0x80;
+  constexpr uint8_t op_run = 0xc0;
+  constexpr uint8_t op_rgb = 0xfe;
+
+  struct rgba_t {
+    uint8_t r = 0, g = 0, b = 0, a = 0;
+    bool operator==(const rgba_t &) const noexcept = default;
+  };
+
+  std::vector<uint8_t> out = {'q', 'o', 'i', 'f'};
+  out.reserve(14 + pixels.size() * 4 + 8);
+  put_u32_be(out, static_cast<uint32_t>(width));
+  put_u32_be(out, static_cast<uint32_t>(height));
+  out.push_back(3); // channels
+  out.push_back(0); // sRGB with linear alpha
+
+  // The index starts zeroed (transparent black), so it never matches one of
+  // our pixels before it's written. The decoder starts from the opaque black.
+  std::array<rgba_t, 64> index{};
+  rgba_t previous{.a = 0xff};
+  int run = 0;
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    const rgba_t pixel{pixels[i].r, pixels[i].g, pixels[i].b, 0xff};
+    if (pixel == previous) {
+      ++run;
+      if (run == 62 || i + 1 == pixels.size()) {
+        out.push_back(op_run | (run - 1));
+        run = 0;
+      }
+      continue;
+    }
+
+    if (run > 0) {
+      out.push_back(op_run | (run - 1));
+      run = 0;
+    }
+
+    const size_t hash =
+        (pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + pixel.a * 11) % 64;
+    if (index[hash] == pixel) {
+      out.push_back(op_index | static_cast<uint8_t>(hash));
+    } else {
+      index[hash] = pixel;
+
+      const int8_t dr = static_cast<int8_t>(pixel.r - previous.r);
+      const int8_t dg = static_cast<int8_t>(pixel.g - previous.g);
+      const int8_t db = static_cast<int8_t>(pixel.b - previous.b);
+      const int8_t dr_dg = static_cast<int8_t>(dr - dg);
+      const int8_t db_dg = static_cast<int8_t>(db - dg);
+
+      if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+        out.push_back(op_diff | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+      } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+                 db_dg >= -8 && db_dg <= 7) {
+        out.push_back(op_luma | (dg + 32));
+        out.push_back(static_cast<uint8_t>((dr_dg + 8) << 4 | (db_dg + 8)));
+      } else {
+        out.insert(out.end(), {op_rgb, pixel.r, pixel.g, pixel.b});
+      }
+    }
+    previous = pixel;
+  }
+
+  out.insert(out.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+  return out;
+}
+
+std::vector<uint8_t> encode_bgra(std::span<const mfb_color> pixels) {
+  static_assert(sizeof(mfb_color) == 4);
+  const auto *bytes = reinterpret_cast<const uint8_t *>(pixels.data());
+  return {bytes, bytes + pixels.size_bytes()};
+}
+
+void write_all(std::FILE *file, const std::vector<uint8_t> &bytes,
+               const std::string &name) {
+  if (std::fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size() ||
+      std::fflush(file) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            fmt::format("unable to write {}", name));
+  }
+}
+
+} // namespace
+
+std::optional<image_format_t>
+parse_image_format(std::string_view name) noexcept {
+  if (name == "ppm")
+    return image_format_t::ppm;
+  if (name == "png")
+    return image_format_t::png;
+  if (name == "qoi")
+    return image_format_t::qoi;
+  if (name == "bgra")
+    return image_format_t::bgra;
+  return std::nullopt;
+}
+
+std::vector<uint8_t> encode_image(image_format_t format,
+                                  std::span<const mfb_color> pixels,
+                                  size_t width, size_t height) {
+  if (pixels.size() != width * height) {
+    throw std::invalid_argument("frame size doesn't match its dimensions");
+  }
+
+  switch (format) {
+  case image_format_t::ppm:
+    return encode_ppm(pixels, width, height);
+  case image_format_t::png:
+    return encode_png(pixels, width, height);
+  case image_format_t::qoi:
+    return encode_qoi(pixels, width, height);
+  case image_format_t::bgra:
+    return encode_bgra(pixels);
+  }
+  throw std::invalid_argument("unknown image format");
+}
+
+frame_output::frame_output(frame_output_options_t options)
+    : options_(std::move(options)),
+      pool_(std::max<size_t>(options_.encoder_threads, 1)) {}
+
+frame_output::~frame_output() {
+  try {
+    flush();
+  } catch (...) {
+  }
+  pool_.join();
+}
+
+void frame_output::submit(std::vector<mfb_color> frame, size_t width,
+                          size_t height) {
+  size_t index = 0;
+  {
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [this] {
+      return pending_ < std::max<size_t>(options_.max_pending_frames, 1) ||
+             error_;
+    });
+    rethrow_error();
+    index = submitted_++;
+    ++pending_;
+  }
+
+  boost::asio::post(pool_, [this, index, width, height,
+                            frame = std::move(frame)] {
+    try {
+      auto bytes = encode_image(options_.format, frame, width, height);
+      if (streaming()) {
+        write_stream(index, std::move(bytes));
+      } else {
+        write_file(index, bytes);
+        finish(nullptr, true);
+      }
+    } catch (...) {
+      finish(std::current_exception(), false);
+    }
+  });
+}
+
+void frame_output::flush() {
+  std::unique_lock lock(mutex_);
+  // After an error the frames behind the failed one are never written.
+  cv_.wait(lock, [this] { return pending_ == 0 || error_; });
+  rethrow_error();
+}
+
+size_t frame_output::frames_written() const {
+  std::lock_guard lock(mutex_);
+  return written_;
+}
+
+void frame_output::write_file(size_t index,
+                              const std::vector<uint8_t> &bytes) {
+  const std::string name =
+      fmt::format(fmt::runtime(options_.destination), index);
+  std::FILE *file = std::fopen(name.c_str(), "wb");
+  if (file == nullptr) {
+    throw std::system_error(errno, std::generic_category(),
+                            fmt::format("unable to open {}", name));
+  }
+  try {
+    write_all(file, bytes, name);
+  } catch (...) {
+    std::fclose(file);
+    throw;
+  }
+  std::fclose(file);
+}
+
+void frame_output::write_stream(size_t index, std::vector<uint8_t> bytes) {
+  std::unique_lock lock(mutex_);
+  reorder_.emplace(index, std::move(bytes));
+  // A single writer keeps the order: it writes out everything that's ready,
+  // frames finished meanwhile are left here for it.
+  if (stream_busy_) {
+    return;
+  }
+  stream_busy_ = true;
+  while (!reorder_.empty() && reorder_.begin()->first == next_to_stream_) {
+    const std::vector<uint8_t> frame = std::move(reorder_.begin()->second);
+    reorder_.erase(reorder_.begin());
+    // A slow pipe mustn't block submit() while there are free slots.
+    lock.unlock();
+    try {
+      write_all(options_.stream, frame, "stdout");
+    } catch (...) {
+      lock.lock();
+      stream_busy_ = false;
+      throw;
+    }
+    lock.lock();
+    ++next_to_stream_;
+    ++written_;
+    --pending_;
+    cv_.notify_all();
+  }
+  stream_busy_ = false;
+}
+
+void frame_output::finish(std::exception_ptr error, bool written) {
+  {
+    std::lock_guard lock(mutex_);
+    --pending_;
+    if (error && !error_) {
+      error_ = error;
+    }
+    if (written) {
+      ++written_;
+    }
+  }
+  cv_.notify_all();
+}
+
+void frame_output::rethrow_error() {
+  if (error_) {
+    std::rethrow_exception(error_);
+  }
+}
+
+} // namespace soft_render
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio/thread_pool.hpp>
+
+#include <soft-render/mfb_color.hpp>
+
+namespace soft_render {
+
+enum class image_format_t {
+  /// Binary PPM (P6), RGB.
+  ppm,
+  /// RGB PNG. Deflate blocks are stored, so it needs no zlib and costs a copy.
+  png,
+  /// "Quite OK Image" format, RGB. Fast lossless compression.
+  qoi,
+  /// Raw frames exactly as they are in memory (b, g, r, a), no header. It's
+  /// meant to be piped to an external encoder, e.g.
+  /// `ffmpeg -f rawvideo -pixel_format bgra -video_size 320x320 -i -`.
+  bgra,
+};
+
+/**
+ * @return the format by its name (the same as the enumerator), nullopt if the
+ * name is unknown.
+ */
+[[nodiscard]] std::optional<image_format_t>
+parse_image_format(std::string_view name) noexcept;
+
+/**
+ * Encodes a frame as render1() produces it: row-major, top-down.
+ */
+[[nodiscard]] std::vector<uint8_t>
+encode_image(image_format_t format, std::span<const mfb_color> pixels,
+             size_t width, size_t height);
+
+struct frame_output_options_t {
+  image_format_t format = image_format_t::ppm;
+  /**
+   * Either "-" to stream all frames to stdout in submission order, or a fmt
+   * pattern that gets the frame number, e.g. "out/frame_{:05}.qoi".
+   */
+  std::string destination = "-";
+  /// Where "-" streams to.
+  std::FILE *stream = stdout;
+  size_t encoder_threads = 2;
+  /**
+   * Frames submitted but not written yet, including encoded frames waiting
+   * for their turn in the stream. submit() blocks once it's reached.
+   */
+  size_t max_pending_frames = 4;
+};
+
+/**
+ * Encodes and writes frames on its own thread pool, so the renderer only pays
+ * for a copy of the buffer. The number of frames in flight is bounded: if the
+ * output can't keep up, submit() waits instead of queueing unbounded memory.
+ *
+ * I/O errors are reported by the next submit() or flush() call.
+ */
+class frame_output {
+public:
+  explicit frame_output(frame_output_options_t options);
+  /// Waits for all submitted frames, errors are swallowed.
+  ~frame_output();
+
+  frame_output(const frame_output &) = delete;
+  frame_output &operator=(const frame_output &) = delete;
+
+  void submit(std::vector<mfb_color> frame, size_t width, size_t height);
+  /// Waits until every submitted frame is written.
+  void flush();
+
+  [[nodiscard]] size_t frames_written() const;
+
+private:
+  [[nodiscard]] bool streaming() const noexcept {
+    return options_.destination == "-";
+  }
+  void write_file(size_t index, const std::vector<uint8_t> &bytes);
+  /// A streamed frame stays pending until it's written, not just encoded.
+  void write_stream(size_t index, std::vector<uint8_t> bytes);
+  /// `written` is false for streamed frames, write_stream() finishes them.
+  void finish(std::exception_ptr error, bool written);
+  void rethrow_error();
+
+  const frame_output_options_t options_;
+  boost::asio::thread_pool pool_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t submitted_ = 0;
+  size_t pending_ = 0;
+  size_t written_ = 0;
+  std::exception_ptr error_;
+
+  /// Encoders finish out of order, the stream must not. Encoded frames wait
+  /// here until every frame before them is written.
+  std::map<size_t, std::vector<uint8_t>> reorder_;
+  size_t next_to_stream_ = 0;
+  /// An encoder thread is writing to the stream, outside of mutex_.
+  bool stream_busy_ = false;
+};
+
+} // namespace soft_render
@@ -1,287 +1,644 @@
 #include "render.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <boost/thread/latch.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fmt/core.h>
 #include <glm/glm.hpp>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <span>
 #include <tuple>
+#include <utility>
 
-namespace soft_render {
+#include <soft-render/geometry.hpp>
+#include <soft-render/geometry_store.hpp>
+#include <soft-render/kernel.hpp>
+#include <soft-render/tile_bins.hpp>
+#include <soft-render/wavefront.hpp>
 
-[[nodiscard]] std::pair<const sphere_t *, float>
-closest_intersection(glm::vec3 origin, glm::vec3 ray, float t_min, float t_max,
-                     const scene_t &scene);
+namespace soft_render {
 
-// light ray from the light point to the object!
-float calculate_diffuse_light(glm::vec3 normal, glm::vec3 light_ray,
-                              float intencity) noexcept {
-  // In general, the intencity changes by cos(angle of the light).
-  // cos(two vectors) == dot product of two normalized vectors.
-  return intencity * glm::dot(normal, glm::normalize(light_ray));
-}
+template <trace_features_t Features, int Depth = Features.max_depth>
+[[nodiscard]] mfb_color trace_ray(const prepared_scene_t &prepared,
+                                  const ray_t &ray, float t_min, float t_max,
+                                  mfb_color background_color = {});
 
 /**
- * @param point_to_camera - "view vector" from a point to a camera. previoulsy
- * we traced the reversed vector.
+ * Colors the closest hit of the ray, reflections included.
  *
- * @return specular coefficient of additional intencity for the ray.
+ * Depth is the number of reflection bounces left. It's a template parameter,
+ * so the recursion is unrolled by the compiler and stops at compile time.
  */
-float calculate_specular_light(glm::vec3 point_to_camera, glm::vec3 normal,
-                               glm::vec3 light_ray, float specular) {
-  if (specular <= -1.0f)
-    return 0.0f;
-  // The picture looks like V (but the light ray in our case goes from the
-  // object). The light ray reflects with the same angle for a normal. Light ray
-  // projection:
-  // * to normal = normal * <normal, light_ray>
-  // * to object = light_ray - normal * <normal, light_ray>
-  // reflected ray is a sum of those two rays.
-  const auto reflected_ray =
-      normal * glm::dot(normal, light_ray) * 2.0f - light_ray;
-  const float r_dot_v = dot(reflected_ray, point_to_camera);
-  if (r_dot_v > 0) {
-    return std::pow(r_dot_v / (length(reflected_ray) * length(point_to_camera)),
-                    specular);
-  }
-  // it's not reflected. do nothing with intencity.
-  return 0.0f;
-}
+template <trace_features_t Features, int Depth = Features.max_depth>
+[[nodiscard]] mfb_color shade_hit(const prepared_scene_t &prepared,
+                                  const ray_t &ray, const hit_t &hit,
+                                  mfb_color background_color = {}) {
+  if (!hit) {
+    return background_color;
+  }
 
-/**
- * @return intensity [0.0f, 1.0f] calculated by available light sources.
- */
-float compute_lightning(glm::vec3 point, glm::vec3 normal, const scene_t &scene,
-                        glm::vec3 point_to_camera, float specular) {
-  float intensity = 0.0f;
-  for (const auto &light : scene.lights) {
-    if (std::holds_alternative<ambient_light_t>(light)) {
-      // It's reflected light, so we don't care about phisics and assume that
-      // all objects emit a bit of light.
-      intensity += std::get<ambient_light_t>(light).intensity;
-    } else {
-      const auto [light_ray, light_intensity, t_max] = std::visit(
-          [point](const auto &light) -> std::tuple<glm::vec3, float, float> {
-            using light_t = std::decay_t<decltype(light)>;
-            if constexpr (std::is_same_v<light_t, directional_light_t>) {
-              // Directional light goes always to one direction.
-              const glm::vec3 light_ray = light.direction;
-              const float t_max = std::numeric_limits<float>::infinity();
-              return {light_ray, light.intensity, t_max};
-            } else if constexpr (std::is_same_v<light_t, point_light_t>) {
-              // Once again, the light goes from the light position to the
-              // object.
-              const glm::vec3 light_ray = light.position - point;
-              const float t_max = 1.0f;
-              return {light_ray, light.intensity, t_max};
-            } else {
-              static_assert("looks like we don't handle some sort of light");
-              return {};
-            }
-          },
-          light);
-
-      // Shadow check
-      const auto [shadow_sphere, shadow_t] =
-          closest_intersection(point, light_ray, 0.001f, t_max, scene);
-      if (shadow_sphere != nullptr) {
-        continue;
-      }
+  const uint32_t material_id = prepared.materials.id(hit);
+  const material_t &material = prepared.materials.materials[material_id];
+  const glm::vec3 point = ray.at(hit.t);
+  const glm::vec3 normal = prepared.geometry.normal_at(hit, point);
+  mfb_color local_color = material.color;
+  const float light = compute_lightning<Features>(
+      point, normal, prepared, -ray.direction, material_id);
+  local_color.set(local_color.as_rgb_vec() * light);
+
+  // If we hit the recursion limit or the object is not reflective, we'ra done
+  if constexpr (!Features.reflections || Depth <= 0) {
+    return local_color;
+  } else {
+    if (material.reflective <= 0) {
+      return local_color;
+    }
+
+    // Compute the reflected color
+    const glm::vec3 reflected_ray = reflect_ray(-ray.direction, normal);
+    const mfb_color reflected_color = trace_ray<Features, Depth - 1>(
+        prepared, ray_t(point, reflected_ray), 0.001f,
+        std::numeric_limits<float>::infinity(), background_color);
 
-      intensity += std::max(
-          calculate_diffuse_light(normal, light_ray, light_intensity), 0.0f);
-      intensity +=
-          light_intensity * calculate_specular_light(point_to_camera, normal,
-                                                     light_ray, specular);
+    if (reflected_color == background_color) {
+      return local_color;
     }
+
+    return mfb_color::from_vec3(
+        local_color.as_rgb_vec() * (1 - material.reflective) +
+        reflected_color.as_rgb_vec() * material.reflective);
   }
-  return std::min(intensity, 1.0f);
 }
 
 /**
- * @return the same point on a projection plane
- * @param canvas - current canvas coordinates (pixels)
+ * The raytraycer detects intersections with a spheres. It could be too close to
+ * the camera (t_min) or too far from camers (t_max). We clip such
+ * intersections.
  */
-[[nodiscard]] glm::vec3
-canvas_to_viewport(glm::vec2 canvas, canvas_size_t canvas_size,
-                   viewport_size_t viewport_size) noexcept {
-  return {// simply scale the coordinate by canvas sizes
-          canvas.x * viewport_size.width / canvas_size.width.as_float(),
-          canvas.y * viewport_size.height / canvas_size.height.as_float(),
-          // z component is a constant because it's a property of the viewport
-          viewport_size.distance};
+template <trace_features_t Features, int Depth>
+mfb_color trace_ray(const prepared_scene_t &prepared, const ray_t &ray,
+                    float t_min, float t_max, mfb_color background_color) {
+  return shade_hit<Features, Depth>(
+      prepared, ray,
+      closest_intersection(prepared.geometry, ray, t_min, t_max),
+      background_color);
 }
 
 /**
- * The function simply finds intersections for a direction `ray` with a sphere
- * by the following equation:
- * <intersection_vec - sphere_vec, intersection_vec - sphere_vec> =
- * sphere_radius ^ 2
- *
- * The intersections must be along the ray vector (it goes from camera position
- * to a projection plane), so the intersection_vec is
- * viewport_position + t * ray.
- *
- * The equation could be transformed to
- * t^2 <ray,ray> + t (2 <viewport_position - sphere_vector, ray>) +
- * <viewport_position - sphere_vector, viewport_position - sphere_vector> -
- * r^2 = 0
+ * Traces the canvas row `j` (counted from the top) from the column `first`.
+ * Primary rays test only the objects binned to their tile.
  */
-[[nodiscard]] std::tuple<float, float>
-intersect_ray_sphere(glm::vec3 viewport_position, glm::vec3 ray,
-                     const sphere_t &sphere) noexcept {
-  // ray == D
-  // a = <D, D>
-  // b = 2<CO, D>
-  // c = <CO, CO> - r^2
-  // at^2 + bt + c = 0
-  const float r = sphere.radius;
-  const glm::vec3 CO = viewport_position - sphere.position;
-
-  const auto a = glm::dot(ray, ray);
-  const auto b = 2 * glm::dot(CO, ray);
-  const auto c = glm::dot(CO, CO) - r * r;
-
-  const auto discriminant = b * b - 4 * a * c;
-  if (discriminant < 0) {
-    return std::tuple(std::numeric_limits<float>::infinity(),
-                      std::numeric_limits<float>::infinity());
-  }
-
-  const float t1 = (-b + sqrt(discriminant)) / (2 * a);
-  const float t2 = (-b - sqrt(discriminant)) / (2 * a);
-  return {t1, t2};
+template <trace_features_t Features>
+void trace_row(const prepared_scene_t &prepared, const camera_setup_t &camera,
+               const tile_bins_t &tiles, size_t first, size_t j,
+               std::span<mfb_color> row) {
+  const glm::vec3 row_start = camera.ray(0, j);
+  for (size_t n = 0; n < row.size(); ++n) {
+    const size_t i = first + n;
+    const ray_t ray(camera.origin,
+                    row_start + camera.step_x * static_cast<float>(i));
+    row[n] = shade_hit<Features>(
+        prepared, ray,
+        closest_primary_intersection(prepared.geometry, tiles, i, j, ray,
+                                     1.0f));
+  }
+}
+
+template <size_t... I>
+constexpr std::array<row_kernel_t, kernel_count>
+make_row_kernels(std::index_sequence<I...>) noexcept {
+  static_assert(((kernel_index(kernel_features(I)) == I) && ...));
+  return {&trace_row<kernel_features(I)>...};
+}
+
+constexpr auto row_kernels =
+    make_row_kernels(std::make_index_sequence<kernel_count>());
+
+[[nodiscard]] row_kernel_t select_row_kernel(trace_features_t features) {
+  features.max_depth = std::clamp(features.max_depth, 0, max_trace_depth);
+  return row_kernels[kernel_index(features)];
+}
+
+trace_features_t select_trace_features(const scene_t &scene,
+                                       render_quality_t quality) {
+  trace_features_t features;
+  switch (quality) {
+  case render_quality_t::preview:
+    return {.max_depth = 0,
+            .shadows = false,
+            .specular = false,
+            .reflections = false};
+  case render_quality_t::draft:
+    features.max_depth = 1;
+    break;
+  case render_quality_t::full:
+    features.max_depth = max_trace_depth;
+    break;
+  }
+
+  features.shadows = std::any_of(
+      scene.lights.begin(), scene.lights.end(), [](const light_t &light) {
+        return !std::holds_alternative<ambient_light_t>(light);
+      });
+  features.specular = false;
+  features.reflections = false;
+  scene.for_each_material([&features](const material_t &material) {
+    features.specular = features.specular || material.specular > -1;
+    features.reflections = features.reflections || material.reflective > 0;
+  });
+  if (!features.reflections) {
+    features.max_depth = 0;
+  }
+  return features;
+}
+
+std::optional<render_pipeline_t>
+parse_render_pipeline(std::string_view name) noexcept {
+  if (name == "megakernel")
+    return render_pipeline_t::megakernel;
+  if (name == "wavefront")
+    return render_pipeline_t::wavefront;
+  return std::nullopt;
+}
+
+std::optional<tile_order_t> parse_tile_order(std::string_view name) noexcept {
+  if (name == "scanline")
+    return tile_order_t::scanline;
+  if (name == "morton")
+    return tile_order_t::morton;
+  return std::nullopt;
+}
+
+std::optional<shadow_mode_t>
+parse_shadow_mode(std::string_view name) noexcept {
+  if (name == "traced")
+    return shadow_mode_t::traced;
+  if (name == "cached")
+    return shadow_mode_t::cached;
+  return std::nullopt;
+}
+
+std::optional<shading_math_t>
+parse_shading_math(std::string_view name) noexcept {
+  if (name == "exact")
+    return shading_math_t::exact;
+  if (name == "fast")
+    return shading_math_t::fast;
+  return std::nullopt;
 }
 
 /**
- * \param origin is a point from where the ray is going.
+ * A frame of render_async(). The workers own it together with the handles:
+ * every tile task holds a reference until it's done.
  */
-[[nodiscard]] std::pair<const sphere_t *, float>
-closest_intersection(glm::vec3 origin, glm::vec3 ray, float t_min, float t_max,
-                     const scene_t &scene) {
-  float closest_t = std::numeric_limits<float>::infinity();
-  const sphere_t *closest_object = nullptr;
-  for (const auto &object : scene.objects) {
-    const auto [t1, t2] = intersect_ray_sphere(origin, ray, object);
-    if (t1 <= t_max && t1 >= t_min && t1 < closest_t) {
-      closest_object = &object;
-      closest_t = t1;
+struct render_job::state_t {
+  std::atomic<bool> cancelled = false;
+  /// Tiles not started by then are skipped, see render_priority_t.
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::time_point::max();
+  std::atomic<size_t> expired = 0;
+
+  mutable std::mutex mutex;
+  std::condition_variable changed;
+  /// Tiles whose tasks haven't finished yet.
+  size_t pending = 0;
+  /// Finished tiles nobody has taken yet.
+  std::deque<render_tile_t> finished;
+  /// The async_next() waiting for a tile.
+  handler_t waiter;
+
+  /// Frame data the tile tasks read.
+  std::vector<render_view_t> views;
+  std::vector<camera_setup_t> cameras;
+  row_kernel_t trace_row = nullptr;
+
+  /// Called by the task of the tile once it's rendered or skipped.
+  void finish(const render_tile_t &tile, bool rendered) {
+    handler_t handler;
+    std::optional<render_tile_t> result;
+    {
+      std::lock_guard lock(mutex);
+      --pending;
+      if (rendered && !cancelled) {
+        finished.push_back(tile);
+      }
+      if (waiter && (!finished.empty() || pending == 0)) {
+        handler = std::move(waiter);
+        waiter = nullptr;
+        result = pop();
+      }
     }
-    if (t2 <= t_max && t2 >= t_min && t2 < closest_t) {
-      closest_object = &object;
-      closest_t = t2;
+    changed.notify_all();
+    if (handler) {
+      handler(result);
+    }
+  }
+
+  /// Must hold the mutex.
+  std::optional<render_tile_t> pop() {
+    if (finished.empty()) {
+      return std::nullopt;
     }
-    if (t1 != std::numeric_limits<float>::infinity() ||
-        t2 != std::numeric_limits<float>::infinity()) {
+    const render_tile_t tile = finished.front();
+    finished.pop_front();
+    return tile;
+  }
+};
+
+std::optional<render_tile_t> render_job::next() {
+  if (!state_) {
+    return std::nullopt;
+  }
+  std::unique_lock lock(state_->mutex);
+  state_->changed.wait(lock, [this] {
+    return !state_->finished.empty() || state_->pending == 0;
+  });
+  return state_->pop();
+}
+
+void render_job::on_next(const std::shared_ptr<state_t> &state,
+                         handler_t handler) {
+  std::optional<render_tile_t> result;
+  {
+    std::unique_lock lock(state->mutex);
+    if (state->finished.empty() && state->pending != 0) {
+      // A job has one consumer, there is no queue of waiters.
+      assert(!state->waiter);
+      state->waiter = std::move(handler);
+      return;
     }
+    result = state->pop();
   }
-  return {closest_object, closest_t};
+  handler(result);
 }
 
-glm::vec3 reflect_ray(glm::vec3 ray, glm::vec3 normal) noexcept {
-  return 2.0f * normal * glm::dot(normal, ray) - ray;
+void render_job::cancel() noexcept {
+  if (!state_) {
+    return;
+  }
+  std::lock_guard lock(state_->mutex);
+  // A finished frame stays finished.
+  if (state_->pending != 0) {
+    state_->cancelled = true;
+    state_->finished.clear();
+  }
+}
+
+void render_job::wait() {
+  if (state_) {
+    std::unique_lock lock(state_->mutex);
+    state_->changed.wait(lock, [this] { return state_->pending == 0; });
+  }
+}
+
+bool render_job::wait_for(std::chrono::milliseconds timeout) {
+  if (!state_) {
+    return true;
+  }
+  std::unique_lock lock(state_->mutex);
+  return state_->changed.wait_for(lock, timeout,
+                                  [this] { return state_->pending == 0; });
+}
+
+bool render_job::done() const {
+  if (!state_) {
+    return true;
+  }
+  std::lock_guard lock(state_->mutex);
+  return state_->pending == 0;
+}
+
+bool render_job::cancelled() const noexcept {
+  return state_ && state_->cancelled;
+}
+
+size_t render_job::expired() const noexcept {
+  return state_ ? state_->expired.load() : 0;
+}
+
+/// @return x and y with their bits interleaved, x in the even bits.
+[[nodiscard]] constexpr uint64_t morton_code(uint32_t x, uint32_t y) noexcept {
+  const auto spread = [](uint64_t v) {
+    v = (v | v << 16) & 0x0000ffff0000ffff;
+    v = (v | v << 8) & 0x00ff00ff00ff00ff;
+    v = (v | v << 4) & 0x0f0f0f0f0f0f0f0f;
+    v = (v | v << 2) & 0x3333333333333333;
+    v = (v | v << 1) & 0x5555555555555555;
+    return v;
+  };
+  return spread(x) | spread(y) << 1;
 }
 
 /**
- * The raytraycer detects intersections with a spheres. It could be too close to
- * the camera (t_min) or too far from camers (t_max). We clip such
- * intersections.
+ * Appends the tiles of the rows [first, last) of a view in the Morton order.
+ * Tiles are aligned to the canvas, so they match the tiles of the tiled
+ * layout; the ones on the edges of the band are cut.
  */
-[[nodiscard]] mfb_color trace_ray(glm::vec3 viewport_position, glm::vec3 ray,
-                                  float t_min, float t_max,
-                                  const scene_t &scene, int recursion_depth = 0,
-                                  mfb_color background_color = {}) {
-  auto [closest_object, closest_t] =
-      closest_intersection(viewport_position, ray, t_min, t_max, scene);
-
-  if (closest_object == nullptr) {
-    return background_color;
+void append_morton_tiles(std::vector<render_tile_t> &tiles, size_t view,
+                         size_t width, size_t first, size_t last) {
+  constexpr size_t size = renderer::tile_size;
+  std::vector<std::pair<uint64_t, render_tile_t>> ordered;
+  for (size_t y = first / size; y * size < last; ++y) {
+    const size_t top = std::max(first, y * size);
+    const size_t bottom = std::min(last, (y + 1) * size);
+    for (size_t x = 0; x * size < width; ++x) {
+      ordered.push_back(
+          {morton_code(static_cast<uint32_t>(x), static_cast<uint32_t>(y)),
+           {.view = view,
+            .first_row = top,
+            .rows = bottom - top,
+            .first_column = x * size,
+            .columns = std::min(size, width - x * size)}});
+    }
+  }
+  std::ranges::sort(ordered, {}, &std::pair<uint64_t, render_tile_t>::first);
+  for (const auto &[code, tile] : ordered) {
+    tiles.push_back(tile);
   }
+}
 
-  const glm::vec3 point = viewport_position + ray * closest_t; // why plus???
-  const glm::vec3 normal = glm::normalize(point - closest_object->position);
-  mfb_color local_color = closest_object->color;
-  const float light = compute_lightning(point, normal, scene, ray * -1.0f,
-                                        closest_object->specular);
-  local_color.set(local_color.as_rgb_vec() * light);
+/**
+ * Orders the tiles of a frame by their distance from the focus, nearest
+ * first, and marks the peripheral ones reduced. Ties keep their order.
+ */
+void prioritize_tiles(std::vector<std::pair<render_tile_t, size_t>> &tiles,
+                      std::span<const render_view_t> views,
+                      const render_priority_t &priority) {
+  const auto distance = [&](const render_tile_t &tile) {
+    const canvas_size_t &canvas = views[tile.view].canvas_size;
+    const auto width = static_cast<float>(canvas.width.as_size());
+    const auto height = static_cast<float>(canvas.height.as_size());
+    const glm::vec2 focus = priority.focus * glm::vec2(width, height);
+    // To the nearest point of the tile.
+    const glm::vec2 nearest = glm::clamp(
+        focus,
+        glm::vec2(static_cast<float>(tile.first_column),
+                  static_cast<float>(tile.first_row)),
+        glm::vec2(static_cast<float>(tile.first_column + tile.columns),
+                  static_cast<float>(tile.first_row + tile.rows)));
+    return glm::length(nearest - focus) / std::max(width, height);
+  };
+
+  std::vector<std::pair<float, size_t>> order;
+  order.reserve(tiles.size());
+  for (size_t t = 0; t < tiles.size(); ++t) {
+    order.emplace_back(distance(tiles[t].first), t);
+  }
+  std::ranges::stable_sort(order, {}, &std::pair<float, size_t>::first);
 
-  // If we hit the recursion limit or the object is not reflective, we'ra done
-  if (recursion_depth <= 0 or closest_object->reflective <= 0) {
-    return local_color;
+  std::vector<std::pair<render_tile_t, size_t>> sorted;
+  sorted.reserve(tiles.size());
+  for (const auto &[d, t] : order) {
+    auto &tile = sorted.emplace_back(tiles[t]);
+    tile.first.reduced = d > priority.full_radius;
   }
+  tiles = std::move(sorted);
+}
 
-  // Compute the reflected color
-  const glm::vec3 reflected_ray = reflect_ray(-ray, normal);
-  const mfb_color reflected_color = trace_ray(
-      point, reflected_ray, 0.001f, std::numeric_limits<float>::infinity(),
-      scene, recursion_depth - 1, background_color);
+struct renderer::node_t {
+  boost::asio::thread_pool pool;
+  /// Node-local copy of the scene geometry. It's synced by the node's own
+  /// workers, so its memory is first touched on the node. It follows the last
+  /// rendered scene across frames.
+  geometry_store_t geometry;
+  std::optional<prepared_scene_t> prepared;
+
+  explicit node_t(const worker_node_t &layout) : pool(layout.threads) {
+    if (layout.cpus.empty()) {
+      return;
+    }
+    // Every worker takes exactly one of the tasks: none of them returns
+    // before all have started.
+    auto started = std::make_shared<boost::latch>(
+        static_cast<std::ptrdiff_t>(layout.threads));
+    for (size_t i = 0; i < layout.threads; ++i) {
+      boost::asio::post(pool, [started, cpus = layout.cpus] {
+        if (!pin_current_thread(cpus)) {
+          fmt::println(stderr, "warning: unable to pin a worker thread");
+        }
+        started->count_down_and_wait();
+      });
+    }
+    started->wait();
+  }
+};
 
-  if (reflected_color == background_color) {
-    return local_color;
+renderer::renderer(worker_topology_t topology)
+    : topology_(std::move(topology)) {
+  if (topology_.nodes.empty()) {
+    topology_ = worker_topology_t::single(1);
   }
+  for (const auto &layout : topology_.nodes) {
+    nodes_.push_back(std::make_unique<node_t>(layout));
+  }
+}
+
+renderer::~renderer() {
+  // The workers of a running frame use the nodes.
+  render_job job(std::move(current_));
+  job.cancel();
+  job.wait();
+}
 
-  return mfb_color::from_vec3(
-      local_color.as_rgb_vec() * (1 - closest_object->reflective) +
-      reflected_color.as_rgb_vec() * closest_object->reflective);
+template <typename F> void renderer::run_on(node_t &node, F &&task) {
+  if (mt_disabled) {
+    task();
+  } else {
+    boost::asio::post(node.pool, std::forward<F>(task));
+  }
 }
 
-renderer::renderer() : pool(16) {}
+framebuffer_t renderer::make_framebuffer(const canvas_size_t &canvas_size,
+                                         pixel_layout_t layout) {
+  const size_t height = canvas_size.height.as_size();
+  // Pixels of a row and the rows a pixel row stands for: a tiled buffer is
+  // touched by rows of tiles, each one by the node its first row belongs to.
+  size_t row_size = canvas_size.width.as_size();
+  size_t row_height = 1;
+  if (layout == pixel_layout_t::tiled) {
+    row_size = tiled_layout_t::of(canvas_size).row_size();
+    row_height = tiled_layout_t::tile_size;
+  }
+  const auto rows_before = [&](size_t n) {
+    return (topology_.first_row(n, height) + row_height - 1) / row_height;
+  };
+  framebuffer_t buffer(rows_before(nodes_.size()) * row_size);
+
+  // Always on the workers, even with MT disabled: that's the whole point.
+  boost::latch sync(static_cast<std::ptrdiff_t>(nodes_.size()));
+  for (size_t n = 0; n < nodes_.size(); ++n) {
+    const size_t first = rows_before(n) * row_size;
+    const size_t last = rows_before(n + 1) * row_size;
+    boost::asio::post(nodes_[n]->pool, [&buffer, &sync, first, last] {
+      std::uninitialized_value_construct(buffer.data() + first,
+                                         buffer.data() + last);
+      sync.count_down();
+    });
+  }
+  sync.wait();
+  return buffer;
+}
 
-void renderer::render1(std::vector<mfb_color> &buffer,
+void renderer::render1(std::span<mfb_color> buffer,
                        const canvas_size_t &canvas_size,
                        const viewport_size_t viewport_size,
                        const scene_t &scene) {
+  const render_view_t view =
+      render_view_t::whole(buffer, canvas_size, viewport_size);
+  render(std::span(&view, 1), scene);
+}
 
-  boost::latch sync(canvas_size.height.as_size());
-
-  /*
-   * Canvas coordinates goes from left-top corner (x goes right, y goes
-   * down). The projection plane has (0,0) in the center and y goes up.
-   */
-  for (ssize_t j = 0; j < canvas_size.height.as_ssize(); ++j) {
-    // y goes from positive to negative (top-down).
-    const auto y = canvas_size.width.as_ssize() / 2 - j;
-
-    const auto task = [this, canvas_size, viewport_size, &scene, y, &buffer, j,
-                       &sync] {
-      std::vector<mfb_color> local_buffer(canvas_size.width.as_size());
-      for (ssize_t i = 0; i < canvas_size.width.as_ssize(); ++i) {
-        // x goes from negative to positive (left-right).
-        const auto x = i - canvas_size.width.as_ssize() / 2;
-        const auto canvas_position =
-            glm::vec2(static_cast<float>(x), static_cast<float>(y));
-        glm::vec3 ray =
-            canvas_to_viewport(canvas_position, canvas_size, viewport_size);
-        const glm::vec3 debug_ray =
-            viewport_size.rotation_matrix * glm::vec4(ray, 1.0f);
-
-        // fmt::println("ray: [{}, {}, {}], debug_ray: [{}, {}, {}]", ray.x,
-        // ray.y, ray.z, debug_ray.x, debug_ray.y, debug_ray.z);
-
-        ray = debug_ray;
-
-        const mfb_color color =
-            trace_ray(viewport_size.position, ray, 1,
-                      std::numeric_limits<float>::infinity(), scene, 3);
-        local_buffer[i] = color;
-      }
+void renderer::render(std::span<const render_view_t> views,
+                      const scene_t &scene) {
+  render_async(views, scene).wait();
+}
 
-      // it should be useless here because we don't use the
-      // same elements in different threads.
-      std::lock_guard lock(buf_mutex);
+render_job renderer::render_async(std::span<const render_view_t> views,
+                                  const scene_t &scene) {
+  // Before anything runs on the workers, they can't report it.
+  scene.validate();
+
+  // The previous frame is obsolete. Its tasks read the node data and the tile
+  // lists we are about to update, so they have to drain first. Tasks that
+  // haven't started return right away.
+  if (current_) {
+    render_job previous(std::move(current_));
+    previous.cancel();
+    previous.wait();
+  }
 
-      std::copy(local_buffer.begin(), local_buffer.end(),
-                std::next(buffer.begin(), j * canvas_size.width.as_size()));
+  // Every node brings its own copy of the scene data up to date.
+  {
+    boost::latch sync(static_cast<std::ptrdiff_t>(nodes_.size()));
+    for (auto &node : nodes_) {
+      run_on(*node, [&node = *node, &scene, &sync] {
+        node.geometry.sync(scene);
+        node.prepared.emplace(scene, node.geometry);
+        sync.count_down();
+      });
+    }
+    sync.wait();
+  }
 
-      sync.count_down();
-    };
+  auto state = std::make_shared<render_job::state_t>();
+  trace_features_t features = select_trace_features(scene, quality_);
+  features.fast_math = math_ == shading_math_t::fast;
+
+  // The cache is shared by the nodes: their geometry copies are the same.
+  if (shadows_ == shadow_mode_t::cached && features.shadows) {
+    const node_t &first = *nodes_.front();
+    const light_table_t &lights = first.prepared->lights;
+    visibility_.sync(scene, first.geometry, lights.point, lights.bounded,
+                     lights.directional);
+    for (auto &node : nodes_) {
+      node->prepared->visibility = &visibility_;
+    }
+  }
+
+  state->trace_row = pipeline_ == render_pipeline_t::wavefront
+                         ? select_wavefront_row_kernel(features)
+                         : select_row_kernel(features);
+
+  state->views.assign(views.begin(), views.end());
+  state->cameras.reserve(views.size());
+  if (tiles_.size() < views.size()) {
+    tiles_.resize(views.size());
+  }
+  for (const render_view_t &view : views) {
+    assert(view.stride >= view.canvas_size.width.as_size());
+    assert(view.layout == pixel_layout_t::tiled ||
+           view.canvas_size.height.as_size() == 0 ||
+           view.target.size() >=
+               (view.canvas_size.height.as_size() - 1) * view.stride +
+                   view.canvas_size.width.as_size());
+    assert(view.layout == pixel_layout_t::linear ||
+           view.target.size() >= tiled_layout_t::of(view.canvas_size).size());
+    state->cameras.emplace_back(view.canvas_size, view.viewport_size);
+  }
+  // Tile lists are small and shared by all nodes.
+  for (size_t v = 0; v < views.size(); ++v) {
+    tiles_[v].build(nodes_.front()->geometry.spheres(), views[v].canvas_size,
+                    views[v].viewport_size);
+  }
 
-    if (mt_disabled) {
-      task();
-    } else {
-      boost::asio::post(pool, task);
+  // Tiles don't cross node bands, a tile is rendered by a single node.
+  std::vector<std::pair<render_tile_t, size_t>> tiles;
+  std::vector<render_tile_t> band;
+  for (size_t v = 0; v < views.size(); ++v) {
+    const size_t width = views[v].canvas_size.width.as_size();
+    const size_t height = views[v].canvas_size.height.as_size();
+    for (size_t n = 0; n < nodes_.size(); ++n) {
+      const size_t first = topology_.first_row(n, height);
+      const size_t last = topology_.first_row(n + 1, height);
+      band.clear();
+      // Square tiles suit the distance from the focus.
+      if (priority_ || tile_order_ == tile_order_t::morton) {
+        append_morton_tiles(band, v, width, first, last);
+      } else {
+        for (size_t j = first; j < last; j += tile_rows) {
+          band.push_back({.view = v,
+                          .first_row = j,
+                          .rows = std::min(tile_rows, last - j),
+                          .columns = width});
+        }
+      }
+      for (const render_tile_t &tile : band) {
+        tiles.emplace_back(tile, n);
+      }
     }
   }
+  if (priority_) {
+    prioritize_tiles(tiles, views, *priority_);
+    if (priority_->deadline) {
+      state->deadline = std::chrono::steady_clock::now() + *priority_->deadline;
+    }
+  }
+  state->pending = tiles.size();
+  current_ = state;
+
+  for (const auto &[tile, n] : tiles) {
+    const prepared_scene_t &prepared = *nodes_[n]->prepared;
+    const tile_bins_t &bins = tiles_[tile.view];
+    run_on(*nodes_[n], [state, tile, &prepared, &bins] {
+      if (state->cancelled) {
+        state->finish(tile, false);
+        return;
+      }
+      if (std::chrono::steady_clock::now() >= state->deadline) {
+        ++state->expired;
+        state->finish(tile, false);
+        return;
+      }
+      const render_view_t &view = state->views[tile.view];
+      const camera_setup_t &camera = state->cameras[tile.view];
+      const size_t end = tile.first_column + tile.columns;
+      for (size_t j = tile.first_row; j < tile.first_row + tile.rows; ++j) {
+        // Pixels go straight to the target. A row of a tiled view is
+        // contiguous only up to the end of a layout tile.
+        for (size_t i = tile.first_column; i < end;) {
+          const size_t count =
+              view.layout == pixel_layout_t::tiled
+                  ? std::min(end - i, tile_size - i % tile_size)
+                  : end - i;
+          const std::span<mfb_color> pixels = view.pixels(i, j, count);
+          if (tile.reduced && (j - tile.first_row) % 2 == 1) {
+            std::ranges::copy(view.pixels(i, j - 1, count), pixels.begin());
+          } else {
+            state->trace_row(prepared, camera, bins, i, j, pixels);
+          }
+          i += count;
+        }
+      }
+      state->finish(tile, true);
+    });
+  }
 
-  sync.wait();
+  return render_job(std::move(state));
 }
 } // namespace soft_render
@@ -1,100 +1,434 @@
 #pragma once
 
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <numeric>
+#include <optional>
+#include <span>
+#include <string_view>
 #include <variant>
 #include <vector>
 
 #include <boost/asio.hpp>
 #include <fmt/format.h>
 #include <glm/gtx/transform.hpp>
+#include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 
+#include <soft-render/framebuffer.hpp>
+#include <soft-render/geometry_store.hpp>
 #include <soft-render/mfb_color.hpp>
 #include <soft-render/scene.hpp>
+#include <soft-render/tile_bins.hpp>
+#include <soft-render/viewport.hpp>
+#include <soft-render/visibility_cache.hpp>
+#include <soft-render/worker_topology.hpp>
 
 namespace soft_render {
 
-class pixel_coordinate_t {
-public:
-  explicit pixel_coordinate_t(size_t c) noexcept : component_(c) {}
-  explicit operator float() const noexcept { return as_float(); }
-  inline float as_float() const noexcept {
-    return static_cast<float>(component_);
-  }
-  inline ssize_t as_ssize() const noexcept {
-    return static_cast<ssize_t>(component_);
-  }
-  inline size_t as_size() const noexcept { return component_; }
+/**
+ * Feature set the tracing kernel is compiled with. Every supported combination
+ * is a separate instantiation, so a disabled feature costs nothing at runtime:
+ * no branches, no recursion, no shadow rays.
+ */
+struct trace_features_t {
+  /// Maximum number of reflection bounces (0 disables reflections).
+  int max_depth = 3;
+  bool shadows = true;
+  bool specular = true;
+  bool reflections = true;
+  /// Approximate lighting math, see shading_math_t::fast.
+  bool fast_math = false;
 
-private:
-  size_t component_;
+  friend bool operator==(const trace_features_t &,
+                         const trace_features_t &) noexcept = default;
 };
 
-template <typename T> struct plane_t {
-  T width{};
-  T height{};
+/// The deepest reflection recursion we have a kernel instantiation for.
+inline constexpr int max_trace_depth = 3;
+
+enum class render_quality_t {
+  /// No shadows, no highlights, no reflections. Flat lit spheres.
+  preview,
+  /// Shadows and highlights with a single reflection bounce.
+  draft,
+  /// Everything the scene uses, up to max_trace_depth bounces.
+  full,
 };
 
-using canvas_size_t = plane_t<pixel_coordinate_t>;
-struct viewport_size_t : plane_t<float> {
-  viewport_size_t() : plane_t({1.0f, 1.0f}), distance(1.0f) {}
-  /// Distance from a viewport position to a projection plane
-  float distance = 1;
-  glm::vec3 position;
-  glm::vec2 rotation;
-  glm::mat4 rotation_matrix = glm::mat4(1.0f);
+/**
+ * How the kernel walks the work of a row.
+ */
+enum class render_pipeline_t {
+  /// One pixel at a time through intersection, shading and reflections.
+  megakernel,
+  /// One stage at a time for the whole row, see wavefront.hpp.
+  wavefront,
+};
 
-  void rotate(glm::vec2 rotation) noexcept {
-    this->rotation = rotation;
+/// @return the pipeline by its name ("megakernel", "wavefront").
+[[nodiscard]] std::optional<render_pipeline_t>
+parse_render_pipeline(std::string_view name) noexcept;
 
-    // fmt::println("rotation: [{}, {}]", rotation.x, rotation.y);
+/**
+ * The order a frame's tiles go to the workers.
+ */
+enum class tile_order_t {
+  /// Full-width bands of renderer::tile_rows rows, top to bottom.
+  scanline,
+  /**
+   * Squares of renderer::tile_size along a Morton (Z-order) curve. A worker's
+   * consecutive tiles are neighbours in both directions, so their primary and
+   * reflection rays keep hitting the objects and BVH nodes already in the
+   * cache. A band only shares a row edge with the next one.
+   */
+  morton,
+};
 
-    glm::mat4 xm(1.0f);
-    if (rotation.x >= 0.001f || rotation.x <= -0.001f) {
-      xm = glm::rotate(xm, glm::radians(glm::abs(rotation.x)),
-                       {glm::sign(rotation.x), 0.0f, 0.0f});
-    }
+/// @return the tile order by its name ("scanline", "morton").
+[[nodiscard]] std::optional<tile_order_t>
+parse_tile_order(std::string_view name) noexcept;
 
-    glm::mat4 ym(1.0f);
-    if (rotation.y >= 0.001f || rotation.y <= -0.001f) {
-      ym = glm::rotate(ym, glm::radians(glm::abs(rotation.y)),
-                       {0.0f, glm::sign(rotation.y), 0.0f});
-    }
+/**
+ * How precisely lights are evaluated at a shaded point.
+ */
+enum class shading_math_t {
+  /// std::pow highlights, every vector normalized with a sqrt and a division.
+  exact,
+  /**
+   * Highlights looked up in a table per specular exponent instead of std::pow,
+   * rsqrt normalization, and the view vector normalized once per point instead
+   * of once per light. The error against the exact math stays within a color
+   * step; the regression driver reports it per scene (--math-report).
+   */
+  fast,
+};
+
+/// @return the shading math by its name ("exact", "fast").
+[[nodiscard]] std::optional<shading_math_t>
+parse_shading_math(std::string_view name) noexcept;
+
+/**
+ * Where shadow rays get their answers.
+ */
+enum class shadow_mode_t {
+  /// Every shadow ray is traced.
+  traced,
+  /**
+   * Looked up in a visibility_cache_t built for the scene's lights and
+   * geometry, rays are traced only near shadow boundaries and for what moved
+   * since. Pays off for static lights: moving a light rebuilds the cache.
+   */
+  cached,
+};
+
+/// @return the shadow mode by its name ("traced", "cached").
+[[nodiscard]] std::optional<shadow_mode_t>
+parse_shadow_mode(std::string_view name) noexcept;
+
+/**
+ * @return the cheapest feature set that renders the scene at the given quality.
+ * Features the scene doesn't use (e.g. no reflective objects) are dropped.
+ */
+[[nodiscard]] trace_features_t select_trace_features(const scene_t &scene,
+                                                     render_quality_t quality);
 
-    rotation_matrix = xm * ym;
+/**
+ * One camera of a multi-view frame. Row j of the view goes to
+ * target[j * stride, j * stride + width): either a buffer of its own
+ * (stride == width) or a sub-rectangle of a shared one, e.g. a half of a split
+ * screen (stride is the width of the whole buffer).
+ *
+ * A tiled view fills a buffer of its own in the tiled_layout_t of its canvas,
+ * it has to be detiled before it's shown.
+ */
+struct render_view_t {
+  std::span<mfb_color> target;
+  size_t stride;
+  canvas_size_t canvas_size;
+  viewport_size_t viewport_size;
+  pixel_layout_t layout = pixel_layout_t::linear;
+
+  /// @return the view that fills the whole `buffer`.
+  [[nodiscard]] static render_view_t
+  whole(std::span<mfb_color> buffer, const canvas_size_t &canvas_size,
+        const viewport_size_t &viewport_size) noexcept {
+    return {buffer, canvas_size.width.as_size(), canvas_size, viewport_size};
+  }
+
+  /**
+   * @return the view that fills the rectangle of `canvas_size` at (x, y) in
+   * a buffer `buffer_width` pixels wide.
+   */
+  [[nodiscard]] static render_view_t
+  rect(std::span<mfb_color> buffer, size_t buffer_width, size_t x, size_t y,
+       const canvas_size_t &canvas_size,
+       const viewport_size_t &viewport_size) noexcept {
+    return {buffer.subspan(y * buffer_width + x), buffer_width, canvas_size,
+            viewport_size};
+  }
+
+  /// @return the view that fills the whole tiled `buffer`.
+  [[nodiscard]] static render_view_t
+  tiled(std::span<mfb_color> buffer, const canvas_size_t &canvas_size,
+        const viewport_size_t &viewport_size) noexcept {
+    return {buffer, canvas_size.width.as_size(), canvas_size, viewport_size,
+            pixel_layout_t::tiled};
+  }
+
+  /**
+   * @return the `count` pixels of row j from column i. In a tiled view they
+   * must not cross a tile.
+   */
+  [[nodiscard]] std::span<mfb_color> pixels(size_t i, size_t j,
+                                            size_t count) const noexcept {
+    if (layout == pixel_layout_t::tiled) {
+      assert(i % tiled_layout_t::tile_size + count <=
+             tiled_layout_t::tile_size);
+      return target.subspan(tiled_layout_t::of(canvas_size).offset(i, j),
+                            count);
+    }
+    return target.subspan(j * stride + i, count);
   }
+};
+
+/// A rectangle of a view that has been rendered.
+struct render_tile_t {
+  /// Index of the view in the frame's views.
+  size_t view = 0;
+  size_t first_row = 0;
+  size_t rows = 0;
+  size_t first_column = 0;
+  size_t columns = 0;
+  /// Only every second row was traced, see render_priority_t::full_radius.
+  bool reduced = false;
+};
+
+/**
+ * Region of interest scheduling, see renderer::set_priority(). Tiles go to
+ * the workers nearest to the focus first, so a frame cut short (by the
+ * deadline or by the next frame) has the part the viewer looks at.
+ */
+struct render_priority_t {
+  /// In every view: (0, 0) is its top left corner, (1, 1) the bottom right.
+  glm::vec2 focus = glm::vec2(0.5f);
+  /**
+   * Tiles farther from the focus than this, in the longer side of the view,
+   * are peripheral: only every second row is traced, the one below copies
+   * it. Infinity renders every tile in full.
+   */
+  float full_radius = std::numeric_limits<float>::infinity();
+  /**
+   * Tiles that haven't started this long after render_async() are skipped
+   * and keep what their target had, i.e. the previous frame. None waits for
+   * all the tiles.
+   */
+  std::optional<std::chrono::microseconds> deadline;
+};
+
+/**
+ * Handle of a frame rendered in the background, see renderer::render_async().
+ *
+ * Finished tiles come out one by one as the workers complete them, in no
+ * particular order: next() blocks for the next one, async_next() completes an
+ * asio handler (e.g. `co_await job.async_next(boost::asio::use_awaitable)`).
+ * Both give nullopt once the frame is done or cancelled and no finished tiles
+ * are left.
+ *
+ * Handles are cheap to copy and refer to the same frame. Dropping them
+ * doesn't stop the frame, cancel() does.
+ */
+class render_job {
+public:
+  struct state_t;
 
-  friend std::ostream &operator<<(std::ostream &os,
-                                  const viewport_size_t &value) {
-    os << value.width << "x" << value.height
-       << ", distance = " << value.distance << ", position = ("
-       << value.position.x << ", " << value.position.y << ", "
-       << value.position.z << ")";
-    // TODO: position
-    return os;
+  render_job() = default;
+  explicit render_job(std::shared_ptr<state_t> state) noexcept
+      : state_(std::move(state)) {}
+
+  /// Blocks until a tile is finished. @return nullopt if none are left.
+  std::optional<render_tile_t> next();
+
+  /**
+   * Asynchronous next(). The handler, `void(std::optional<render_tile_t>)`,
+   * runs on its associated executor.
+   */
+  template <typename CompletionToken>
+  auto async_next(CompletionToken &&token) {
+    return boost::asio::async_initiate<CompletionToken,
+                                       void(std::optional<render_tile_t>)>(
+        [](auto handler, std::shared_ptr<state_t> state) {
+          auto work = boost::asio::make_work_guard(
+              boost::asio::get_associated_executor(handler));
+          auto complete = [handler = std::move(handler),
+                           work = std::move(work)](
+                              std::optional<render_tile_t> tile) mutable {
+            const auto executor = work.get_executor();
+            boost::asio::post(executor,
+                              [handler = std::move(handler), tile]() mutable {
+                                std::move(handler)(tile);
+                              });
+            work.reset();
+          };
+          on_next(state, std::move(complete));
+        },
+        token, state_);
   }
+
+  /**
+   * Stops the frame. Tiles that haven't been started are skipped, the ones in
+   * flight still finish but aren't reported. The frame buffer keeps a mix of
+   * the new and the previous frame.
+   */
+  void cancel() noexcept;
+
+  /// Blocks until no worker touches the frame anymore.
+  void wait();
+  /// @return true if the frame is done (or cancelled and drained).
+  bool wait_for(std::chrono::milliseconds timeout);
+
+  [[nodiscard]] bool done() const;
+  [[nodiscard]] bool cancelled() const noexcept;
+  /// @return the tiles skipped for the deadline, see render_priority_t.
+  [[nodiscard]] size_t expired() const noexcept;
+
+private:
+  using handler_t =
+      std::move_only_function<void(std::optional<render_tile_t>)>;
+
+  /// Calls the handler with the next tile, from a worker if none is ready.
+  static void on_next(const std::shared_ptr<state_t> &state,
+                      handler_t handler);
+
+  std::shared_ptr<state_t> state_;
 };
 
 class renderer {
 public:
-  renderer();
+  explicit renderer(worker_topology_t topology = worker_topology_t::detect());
+  ~renderer();
 
-  void render1(std::vector<mfb_color> &buffer, const canvas_size_t &canvas_size,
+  void render1(std::span<mfb_color> buffer, const canvas_size_t &canvas_size,
                const viewport_size_t viewport_size, const scene_t &scene);
 
+  /**
+   * Renders the scene from several cameras at once. The scene is prepared
+   * once per worker node for all of them (geometry sync, light tables) and the
+   * rows of all views go to the workers as one job, so there are no idle cores
+   * between the views. Views must not overlap.
+   *
+   * Every node renders a contiguous band of rows of each view.
+   */
+  void render(std::span<const render_view_t> views, const scene_t &scene);
+
+  /**
+   * Starts rendering the views and returns right away. The frame is split in
+   * tiles of up to tile_rows rows that the job reports as they finish.
+   *
+   * A new frame pre-empts the previous one: if it's still running, it's
+   * cancelled and its workers are drained first (they share the node data the
+   * new frame updates). The views' targets and the scene must stay alive until
+   * the job is done; the renderer must outlive it.
+   *
+   * @throw std::invalid_argument if the scene isn't valid, see
+   * scene_t::validate().
+   */
+  [[nodiscard]] render_job render_async(std::span<const render_view_t> views,
+                                        const scene_t &scene);
+
+  /// Rows of a render_async() tile in the scanline order.
+  static constexpr size_t tile_rows = 8;
+  /// Sides of a render_async() tile in the Morton order, a tiled layout tile.
+  static constexpr size_t tile_size = tiled_layout_t::tile_size;
+
+  /**
+   * @return a frame buffer for views of `canvas_size` whose row bands are
+   * first touched by the nodes that render them. Pixels are zeroed.
+   *
+   * A tiled buffer has the size of the tiled_layout_t, each node touches the
+   * rows of tiles that start in its band.
+   */
+  [[nodiscard]] framebuffer_t
+  make_framebuffer(const canvas_size_t &canvas_size,
+                   pixel_layout_t layout = pixel_layout_t::linear);
+
+  [[nodiscard]] const worker_topology_t &topology() const noexcept {
+    return topology_;
+  }
+
   inline void disable_mt() noexcept { mt_disabled = true; }
   inline void enable_mt() noexcept { mt_disabled = false; }
   inline void toggle_mt() noexcept { mt_disabled = !mt_disabled; }
 
+  inline void set_quality(render_quality_t q) noexcept { quality_ = q; }
+  [[nodiscard]] inline render_quality_t quality() const noexcept {
+    return quality_;
+  }
+
+  inline void set_pipeline(render_pipeline_t p) noexcept { pipeline_ = p; }
+  [[nodiscard]] inline render_pipeline_t pipeline() const noexcept {
+    return pipeline_;
+  }
+
+  inline void set_math(shading_math_t m) noexcept { math_ = m; }
+  [[nodiscard]] inline shading_math_t math() const noexcept { return math_; }
+
+  inline void set_shadows(shadow_mode_t m) noexcept { shadows_ = m; }
+  [[nodiscard]] inline shadow_mode_t shadows() const noexcept {
+    return shadows_;
+  }
+  /// Of shadow_mode_t::cached, it follows the last rendered scene.
+  [[nodiscard]] const visibility_cache_t &visibility_cache() const noexcept {
+    return visibility_;
+  }
+
+  /**
+   * Renders square tiles nearest to the focus first, with peripheral tiles
+   * reduced and a deadline if the priority asks for them. The tile order is
+   * ignored then. None (the default) renders all the tiles in full.
+   */
+  inline void set_priority(std::optional<render_priority_t> p) noexcept {
+    priority_ = p;
+  }
+  [[nodiscard]] inline const std::optional<render_priority_t> &
+  priority() const noexcept {
+    return priority_;
+  }
+
+  inline void set_tile_order(tile_order_t o) noexcept { tile_order_ = o; }
+  [[nodiscard]] inline tile_order_t tile_order() const noexcept {
+    return tile_order_;
+  }
+
 private:
-  boost::asio::thread_pool pool;
-  std::mutex buf_mutex;
+  /// Workers of a worker_node_t and the scene data local to them.
+  struct node_t;
+
+  /// Runs the task on the node's workers, right away if MT is disabled.
+  template <typename F> void run_on(node_t &node, F &&task);
+
+  worker_topology_t topology_;
+  std::vector<std::unique_ptr<node_t>> nodes_;
+  /// The last frame of render_async(), it's pre-empted by the next one.
+  std::shared_ptr<render_job::state_t> current_;
+  /// Primary ray object lists, one per view, rebuilt every frame.
+  std::vector<tile_bins_t> tiles_;
+  /// Read by the workers of all nodes, updated between frames.
+  visibility_cache_t visibility_;
   bool mt_disabled = true;
+  render_quality_t quality_ = render_quality_t::full;
+  render_pipeline_t pipeline_ = render_pipeline_t::megakernel;
+  shading_math_t math_ = shading_math_t::exact;
+  tile_order_t tile_order_ = tile_order_t::scanline;
+  shadow_mode_t shadows_ = shadow_mode_t::traced;
+  std::optional<render_priority_t> priority_;
 };
 
 } // namespace soft_render
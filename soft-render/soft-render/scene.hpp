@@ -1,5 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -17,6 +26,39 @@ struct sphere_t {
   float reflective = 0.5f;
 };
 
+/// Surface of an object, the non-geometric part of sphere_t.
+struct material_t {
+  mfb_color color;
+  float specular = -1.0f;
+  float reflective = 0.5f;
+
+  [[nodiscard]] static material_t of(const sphere_t &sphere) noexcept {
+    return {sphere.color, sphere.specular, sphere.reflective};
+  }
+};
+
+/**
+ * Geometry stored once and placed many times by instances. The spheres are in
+ * the prototype's own space.
+ */
+struct prototype_t {
+  std::vector<sphere_t> objects;
+};
+
+/**
+ * A copy of a prototype in the scene. It costs a transform and a material, no
+ * matter how much geometry the prototype has.
+ */
+struct instance_t {
+  /// Index into scene_t::prototypes.
+  uint32_t prototype = 0;
+  /// Prototype space to the world. Any invertible affine transform: a sphere
+  /// turns into an ellipsoid under a non-uniform scale.
+  glm::mat4 transform = glm::mat4(1.0f);
+  /// Replaces the materials of all the prototype's spheres.
+  std::optional<material_t> material;
+};
+
 struct ambient_light_t {
   float intensity = 0.0f;
 };
@@ -29,16 +71,225 @@ struct directional_light_t {
 struct point_light_t {
   float intensity = 0.0f;
   glm::vec3 position;
+  /// The light fades out to nothing at this distance. Infinity: no falloff.
+  /// It must be positive, see scene_t::validate().
+  float range = std::numeric_limits<float>::infinity();
+
+  [[nodiscard]] bool bounded() const noexcept {
+    return range < std::numeric_limits<float>::infinity();
+  }
+
+  /**
+   * Smooth window: 1 at the light, 0 at the range and beyond.
+   *
+   * @param distance2 - squared distance from the light.
+   */
+  [[nodiscard]] float attenuation(float distance2) const noexcept {
+    const float x = distance2 / (range * range);
+    const float window = 1.0f - x * x;
+    return window > 0.0f ? window * window : 0.0f;
+  }
 };
 
 using light_t =
     std::variant<ambient_light_t, directional_light_t, point_light_t>;
 
+/**
+ * Log of geometry changes. Each change gets a revision, so every consumer
+ * (e.g. a renderer with its acceleration structure) picks up only what changed
+ * since the revision it has seen, and pays for the changed objects only.
+ *
+ * The log is bounded by the number of objects: when it's full, the older half
+ * is dropped. Consumers that lag behind the dropped part rebuild everything,
+ * which costs about as much as replaying that many changes anyway.
+ */
+struct change_log_t {
+  uint64_t revision = 0;
+  /// Consumers at an older revision can't replay the log.
+  uint64_t oldest = 0;
+  /// (revision, object index), sorted by revision.
+  std::vector<std::pair<uint64_t, size_t>> entries;
+
+  void record(size_t index, size_t object_count) {
+    ++revision;
+    if (!entries.empty() && entries.size() >= object_count) {
+      const auto half = entries.begin() + (entries.size() + 1) / 2;
+      oldest = std::prev(half)->first;
+      entries.erase(entries.begin(), half);
+    }
+    entries.emplace_back(revision, index);
+  }
+
+  void reset() noexcept {
+    ++revision;
+    entries.clear();
+    oldest = revision;
+  }
+
+  /// See scene_t::for_each_change().
+  template <typename F> bool for_each(uint64_t since, F &&f) const {
+    if (since < oldest) {
+      return false;
+    }
+    const auto first = std::partition_point(
+        entries.begin(), entries.end(),
+        [since](const auto &entry) { return entry.first <= since; });
+    for (auto it = first; it != entries.end(); ++it) {
+      f(it->second);
+    }
+    return true;
+  }
+};
+
+/**
+ * Identity of a scene's contents. Every scene gets a new generation when it's
+ * constructed, copied or assigned, so a consumer doesn't take another scene
+ * at the same address for the one it has synced with.
+ */
+class scene_generation_t {
+public:
+  scene_generation_t() noexcept : value_(next()) {}
+  scene_generation_t(const scene_generation_t &) noexcept : value_(next()) {}
+  scene_generation_t &operator=(const scene_generation_t &) noexcept {
+    value_ = next();
+    return *this;
+  }
+
+  /// Never 0, consumers use it for "no scene".
+  [[nodiscard]] uint64_t value() const noexcept { return value_; }
+
+private:
+  [[nodiscard]] static uint64_t next() noexcept {
+    static std::atomic<uint64_t> last = 0;
+    return ++last;
+  }
+
+  uint64_t value_;
+};
+
 struct scene_t {
   std::vector<light_t> lights;
+  /**
+   * Positions and radii must be changed through the functions below, so the
+   * change is tracked. Materials (color, specular, reflective) may be written
+   * directly: they are read from here every frame.
+   */
   std::vector<sphere_t> objects;
   // A viewport is not here because you can render the same scene from different
-  // camers (split screen).
+  // camers (split screen), see renderer::render().
+
+  /**
+   * Prototypes can only be added, their geometry is built once. Materials of
+   * their spheres may be written directly.
+   */
+  std::vector<prototype_t> prototypes = {};
+  /**
+   * Transforms must be changed through set_transform(), prototypes mustn't be
+   * changed at all. Material overrides may be written directly.
+   */
+  std::vector<instance_t> instances = {};
+
+  /// Don't touch them directly, they are public to keep the scene an
+  /// aggregate.
+  change_log_t changes = {};
+  change_log_t instance_changes = {};
+  scene_generation_t identity = {};
+
+  void set_position(size_t index, glm::vec3 position) {
+    objects[index].position = position;
+    changes.record(index, objects.size());
+  }
+
+  void translate(size_t index, glm::vec3 offset) {
+    set_position(index, objects[index].position + offset);
+  }
+
+  void set_radius(size_t index, float radius) {
+    objects[index].radius = radius;
+    changes.record(index, objects.size());
+  }
+
+  /// Adding objects changes the topology, consumers rebuild.
+  size_t add_object(const sphere_t &object) {
+    objects.push_back(object);
+    changes.reset();
+    return objects.size() - 1;
+  }
+
+  size_t add_prototype(prototype_t prototype) {
+    prototypes.push_back(std::move(prototype));
+    instance_changes.reset();
+    return prototypes.size() - 1;
+  }
+
+  size_t add_instance(const instance_t &instance) {
+    instances.push_back(instance);
+    instance_changes.reset();
+    return instances.size() - 1;
+  }
+
+  void set_transform(size_t index, const glm::mat4 &transform) {
+    instances[index].transform = transform;
+    instance_changes.record(index, instances.size());
+  }
+
+  /**
+   * Checks what the renderer can't render.
+   *
+   * @throw std::invalid_argument if a point light's range isn't positive.
+   */
+  void validate() const {
+    for (const auto &light : lights) {
+      const auto *point = std::get_if<point_light_t>(&light);
+      // NaN fails it too.
+      if (point != nullptr && !(point->range > 0.0f)) {
+        throw std::invalid_argument("point light range must be positive");
+      }
+    }
+  }
+
+  /// See scene_generation_t, revisions are of the same generation only.
+  [[nodiscard]] uint64_t generation() const noexcept {
+    return identity.value();
+  }
+  [[nodiscard]] uint64_t revision() const noexcept { return changes.revision; }
+  [[nodiscard]] uint64_t instance_revision() const noexcept {
+    return instance_changes.revision;
+  }
+
+  /**
+   * Calls `f(index)` for every object changed after the revision `since`. An
+   * object may be reported more than once.
+   *
+   * @return false if the log doesn't reach back to `since`, everything must be
+   * considered changed then.
+   */
+  template <typename F> bool for_each_change(uint64_t since, F &&f) const {
+    return changes.for_each(since, std::forward<F>(f));
+  }
+
+  /// for_each_change() of the instances.
+  template <typename F>
+  bool for_each_instance_change(uint64_t since, F &&f) const {
+    return instance_changes.for_each(since, std::forward<F>(f));
+  }
+
+  /// Calls `f(material)` for every material a ray may hit.
+  template <typename F> void for_each_material(F &&f) const {
+    for (const auto &object : objects) {
+      f(material_t::of(object));
+    }
+    for (const auto &prototype : prototypes) {
+      for (const auto &object : prototype.objects) {
+        f(material_t::of(object));
+      }
+    }
+    for (const auto &instance : instances) {
+      if (instance.material) {
+        f(*instance.material);
+      }
+    }
+  }
 };
 
 } // namespace soft_render
@@ -0,0 +1,143 @@
+#include "tile_bins.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include <glm/glm.hpp>
+
+namespace soft_render {
+
+namespace {
+
+/**
+ * Projection of a circle (center (c, z), radius r) onto the line z = distance
+ * as seen from the origin. The sphere is in front of the origin (z > r), so
+ * both tangents from the origin go forward and the projection is bounded.
+ *
+ * @return [low, high] on the projection line.
+ */
+[[nodiscard]] std::pair<float, float> project_extent(float c, float z, float r,
+                                                     float distance) noexcept {
+  const float center = std::atan2(c, z);
+  const float half_angle = std::asin(r / std::sqrt(c * c + z * z));
+  return {distance * std::tan(center - half_angle),
+          distance * std::tan(center + half_angle)};
+}
+
+} // namespace
+
+void tile_bins_t::build(std::span<const sphere_geometry_t> spheres,
+                        const canvas_size_t &canvas_size,
+                        const viewport_size_t &viewport_size) {
+  const size_t width = canvas_size.width.as_size();
+  const size_t height = canvas_size.height.as_size();
+  columns_ = (width + tile_size - 1) / tile_size;
+  rows_ = (height + tile_size - 1) / tile_size;
+  const size_t tiles = columns_ * rows_;
+  offsets_.assign(tiles + 1, 0);
+  objects_.clear();
+  if (tiles == 0) {
+    return;
+  }
+
+  // Camera axes in the world, the rotation keeps them orthonormal.
+  const glm::vec3 right =
+      viewport_size.rotation_matrix * glm::vec4(1.0f, 0.0f, 0.0f, 0.0f);
+  const glm::vec3 up =
+      viewport_size.rotation_matrix * glm::vec4(0.0f, 1.0f, 0.0f, 0.0f);
+  const glm::vec3 forward =
+      viewport_size.rotation_matrix * glm::vec4(0.0f, 0.0f, 1.0f, 0.0f);
+
+  // The same canvas mapping as camera_setup_t: the pixel (i, j) looks through
+  // ((left + i) * pixel_width, (top - j) * pixel_height) on the plane.
+  const float distance = viewport_size.distance;
+  const float pixel_width = viewport_size.width / canvas_size.width.as_float();
+  const float pixel_height =
+      viewport_size.height / canvas_size.height.as_float();
+  const auto left = static_cast<float>(-(canvas_size.width.as_ssize() / 2));
+  const auto top = static_cast<float>(canvas_size.height.as_ssize() / 2);
+
+  const tile_range_t everything = {0, columns_ - 1, 0, rows_ - 1};
+  // A point on the plane to canvas coordinates, clamped to a pixel outside of
+  // the canvas. Projected ranges get another pixel of margin for rounding.
+  const auto column_of = [&](float x) {
+    return std::clamp(x / pixel_width - left, -1.0f,
+                      static_cast<float>(width));
+  };
+  const auto row_of = [&](float y) {
+    return std::clamp(top - y / pixel_height, -1.0f,
+                      static_cast<float>(height));
+  };
+
+  ranges_.resize(spheres.size());
+  for (size_t s = 0; s < spheres.size(); ++s) {
+    const sphere_geometry_t &sphere = spheres[s];
+    const glm::vec3 to_center = sphere.position - viewport_size.position;
+    const glm::vec3 center(glm::dot(to_center, right), glm::dot(to_center, up),
+                           glm::dot(to_center, forward));
+
+    std::optional<tile_range_t> &range = ranges_[s];
+    if (center.z + sphere.radius < distance) {
+      // Primary rays start on the projection plane, the sphere is before it.
+      range.reset();
+      continue;
+    }
+    if (center.z - sphere.radius <= 0.0f) {
+      // Around or behind the camera: the projection isn't bounded.
+      range = everything;
+    } else {
+      const auto [x_low, x_high] =
+          project_extent(center.x, center.z, sphere.radius, distance);
+      const auto [y_low, y_high] =
+          project_extent(center.y, center.z, sphere.radius, distance);
+      const float first_i = std::floor(column_of(x_low)) - 1.0f;
+      const float last_i = std::ceil(column_of(x_high)) + 1.0f;
+      const float first_j = std::floor(row_of(y_high)) - 1.0f;
+      const float last_j = std::ceil(row_of(y_low)) + 1.0f;
+      if (last_i < 0.0f || last_j < 0.0f ||
+          first_i >= static_cast<float>(width) ||
+          first_j >= static_cast<float>(height)) {
+        range.reset();
+        continue;
+      }
+
+      const auto tile_of = [](float pixel, size_t last) {
+        return std::min(static_cast<size_t>(std::max(pixel, 0.0f)) / tile_size,
+                        last);
+      };
+      range = tile_range_t{tile_of(first_i, columns_ - 1),
+                           tile_of(last_i, columns_ - 1),
+                           tile_of(first_j, rows_ - 1),
+                           tile_of(last_j, rows_ - 1)};
+    }
+
+    for (size_t row = range->first_row; row <= range->last_row; ++row) {
+      for (size_t column = range->first_column; column <= range->last_column;
+           ++column) {
+        ++offsets_[row * columns_ + column + 1];
+      }
+    }
+  }
+
+  // Counts to offsets, then fill the lists in the object order.
+  for (size_t tile = 0; tile < tiles; ++tile) {
+    offsets_[tile + 1] += offsets_[tile];
+  }
+  objects_.resize(offsets_[tiles]);
+  next_.assign(offsets_.begin(), offsets_.end() - 1);
+  for (size_t s = 0; s < spheres.size(); ++s) {
+    const auto &range = ranges_[s];
+    if (!range) {
+      continue;
+    }
+    for (size_t row = range->first_row; row <= range->last_row; ++row) {
+      for (size_t column = range->first_column; column <= range->last_column;
+           ++column) {
+        objects_[next_[row * columns_ + column]++] = static_cast<uint32_t>(s);
+      }
+    }
+  }
+}
+
+} // namespace soft_render
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <soft-render/geometry.hpp>
+#include <soft-render/geometry_store.hpp>
+#include <soft-render/viewport.hpp>
+
+namespace soft_render {
+
+/**
+ * Per-frame lists of the objects primary rays of a canvas tile may hit.
+ *
+ * Every sphere is projected onto the canvas by the view's camera and its
+ * index goes to the tiles its silhouette overlaps. A primary ray then tests
+ * only the list of its tile instead of walking the BVH from the root. Lists
+ * are conservative: a listed object may miss, an unlisted one can't be hit by
+ * a primary ray.
+ */
+class tile_bins_t {
+public:
+  static constexpr size_t tile_size = 16;
+  /// A tile with more objects than that is left to the BVH.
+  static constexpr size_t max_tile_objects = 32;
+
+  void build(std::span<const sphere_geometry_t> spheres,
+             const canvas_size_t &canvas_size,
+             const viewport_size_t &viewport_size);
+
+  /**
+   * @return the objects a primary ray through the pixel (i, j) may hit,
+   * nullopt if the tile is too crowded and the BVH does better.
+   */
+  [[nodiscard]] std::optional<std::span<const uint32_t>>
+  objects_at(size_t i, size_t j) const noexcept {
+    const size_t tile = (j / tile_size) * columns_ + i / tile_size;
+    const uint32_t first = offsets_[tile];
+    const uint32_t count = offsets_[tile + 1] - first;
+    if (count > max_tile_objects) {
+      return std::nullopt;
+    }
+    return std::span(objects_).subspan(first, count);
+  }
+
+private:
+  /// Tiles a sphere covers, [first, last] inclusive.
+  struct tile_range_t {
+    size_t first_column;
+    size_t last_column;
+    size_t first_row;
+    size_t last_row;
+  };
+
+  size_t columns_ = 0;
+  size_t rows_ = 0;
+  /// Tile -> the first entry of its list in objects_, tiles + 1 entries.
+  std::vector<uint32_t> offsets_;
+  std::vector<uint32_t> objects_;
+  /// Scratch: tiles of every sphere, nullopt for culled ones.
+  std::vector<std::optional<tile_range_t>> ranges_;
+  /// Scratch: the next free entry of every tile list.
+  std::vector<uint32_t> next_;
+};
+
+/**
+ * Closest hit of a primary ray through the pixel (i, j): the tile list if it
+ * has one, the BVH otherwise. Instances aren't binned, they always go through
+ * their hierarchy.
+ */
+[[nodiscard]] inline hit_t
+closest_primary_intersection(const geometry_store_t &store,
+                             const tile_bins_t &tiles, size_t i, size_t j,
+                             const ray_t &ray, float t_min) noexcept {
+  const auto objects = tiles.objects_at(i, j);
+  if (!objects) {
+    return closest_intersection(store, ray, t_min,
+                                std::numeric_limits<float>::infinity());
+  }
+
+  hit_t hit;
+  const auto &spheres = store.spheres();
+  for (const uint32_t object : *objects) {
+    const auto [t1, t2] = intersect_ray_sphere(ray, spheres[object]);
+    if (t1 >= t_min && t1 < hit.t) {
+      hit = {.object = object, .t = t1};
+    }
+    if (t2 >= t_min && t2 < hit.t) {
+      hit = {.object = object, .t = t2};
+    }
+  }
+  if (!store.instances().empty()) {
+    float t_max = hit.t;
+    closest_instance_hit(store, ray, t_min, t_max, hit);
+  }
+  return hit;
+}
+
+} // namespace soft_render
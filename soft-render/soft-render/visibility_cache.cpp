@@ -0,0 +1,363 @@
+#include "visibility_cache.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include <soft-render/bvh.hpp>
+
+namespace soft_render {
+
+namespace {
+
+/// @return the unit direction of the point `p` on the cube face.
+[[nodiscard]] glm::vec3 face_direction(int face, glm::vec2 p) noexcept {
+  const int axis = face / 2;
+  glm::vec3 direction;
+  direction[axis] = face % 2 == 0 ? 1.0f : -1.0f;
+  direction[(axis + 1) % 3] = p.x;
+  direction[(axis + 2) % 3] = p.y;
+  return glm::normalize(direction);
+}
+
+/// @return the cube face the direction goes through and the point on it.
+[[nodiscard]] std::pair<int, glm::vec2> face_of(glm::vec3 direction) noexcept {
+  const glm::vec3 a = glm::abs(direction);
+  const int axis = a.x >= a.y && a.x >= a.z ? 0 : (a.y >= a.z ? 1 : 2);
+  const glm::vec2 p(direction[(axis + 1) % 3], direction[(axis + 2) % 3]);
+  return {axis * 2 + (direction[axis] < 0.0f ? 1 : 0), p / a[axis]};
+}
+
+[[nodiscard]] float distance_to_segment(glm::vec3 p, glm::vec3 a,
+                                        glm::vec3 b) noexcept {
+  const glm::vec3 ab = b - a;
+  const float length2 = glm::dot(ab, ab);
+  const float t =
+      length2 > 0.0f ? std::clamp(glm::dot(p - a, ab) / length2, 0.0f, 1.0f)
+                     : 0.0f;
+  return glm::length(p - (a + ab * t));
+}
+
+} // namespace
+
+/// A sphere and a light whose tree is being built.
+struct visibility_cache_t::receiver_t {
+  glm::vec3 center;
+  float radius;
+  uint32_t object;
+  glm::vec4 light;
+  /// Of the light, infinite without one.
+  float range;
+  /// Covers the error of hit points and normals, they are a bit off the
+  /// surface and the cell.
+  float slack;
+};
+
+void visibility_cache_t::sync(
+    const scene_t &scene, const geometry_store_t &geometry,
+    std::span<const point_light_t> point,
+    std::span<const point_light_t> bounded,
+    std::span<const directional_light_t> directional) {
+  std::vector<glm::vec4> lights;
+  std::vector<float> ranges;
+  for (const auto lights_of_kind : {point, bounded}) {
+    for (const point_light_t &light : lights_of_kind) {
+      lights.emplace_back(light.position, 1.0f);
+      ranges.push_back(light.range);
+    }
+  }
+  for (const directional_light_t &light : directional) {
+    lights.emplace_back(light.direction, 0.0f);
+    ranges.push_back(std::numeric_limits<float>::infinity());
+  }
+
+  bool rebuild = generation_ != scene.generation() || lights != lights_ ||
+                 ranges != ranges_ || object_count_ != scene.objects.size();
+  if (!rebuild) {
+    rebuild = !scene.for_each_change(revision_, [this](size_t i) {
+      if (!is_moved_[i]) {
+        is_moved_[i] = true;
+        moved_.push_back(static_cast<uint32_t>(i));
+      }
+    });
+    revision_ = scene.revision();
+    instances_moved_ = instances_moved_ ||
+                       instance_revision_ != scene.instance_revision();
+    // Moved objects only ever add up: past the limit, every lit answer would
+    // be traced again, a fresh cache answers them.
+    rebuild = rebuild || moved_.size() > max_moved_tests;
+  }
+  if (rebuild) {
+    lights_ = std::move(lights);
+    ranges_ = std::move(ranges);
+    build(scene, geometry);
+  }
+}
+
+void visibility_cache_t::build(const scene_t &scene,
+                               const geometry_store_t &geometry) {
+  ++builds_;
+  generation_ = scene.generation();
+  object_count_ = scene.objects.size();
+  revision_ = scene.revision();
+  instance_revision_ = scene.instance_revision();
+  instances_moved_ = false;
+  is_moved_.assign(object_count_, false);
+  moved_.clear();
+
+  const auto &spheres = geometry.spheres();
+  occluders_.clear();
+  aabb_t bounds;
+  float min_radius = std::numeric_limits<float>::infinity();
+  for (size_t i = 0; i < spheres.size(); ++i) {
+    occluders_.push_back({spheres[i].position, spheres[i].radius,
+                          static_cast<uint32_t>(i)});
+    bounds.grow(aabb_t::of(spheres[i]));
+    min_radius = std::min(min_radius, spheres[i].radius);
+  }
+  // Instances only by their bounding spheres, they never prove a shadow.
+  std::vector<uint32_t> instances;
+  for (const instance_t &instance : scene.instances) {
+    const aabb_t &local = geometry.prototypes()[instance.prototype].bounds;
+    aabb_t world;
+    for (int corner = 0; corner < 8; ++corner) {
+      const glm::vec3 p((corner & 1) ? local.max.x : local.min.x,
+                        (corner & 2) ? local.max.y : local.min.y,
+                        (corner & 4) ? local.max.z : local.min.z);
+      world.grow(glm::vec3(instance.transform * glm::vec4(p, 1.0f)));
+    }
+    instances.push_back(static_cast<uint32_t>(occluders_.size()));
+    occluders_.push_back({(world.min + world.max) * 0.5f,
+                          glm::length(world.extent()) * 0.5f, no_object});
+    bounds.grow(world);
+  }
+  scene_center_ = (bounds.min + bounds.max) * 0.5f;
+  scene_radius_ = glm::length(bounds.extent()) * 0.5f;
+  min_cell_ = min_radius * min_cell_ratio;
+
+  roots_.assign(object_count_ * lights_.size(), no_tree);
+  nodes_.clear();
+  std::vector<uint32_t> near;
+  for (size_t o = 0; o < object_count_; ++o) {
+    const sphere_geometry_t &sphere = spheres[o];
+    for (size_t l = 0; l < lights_.size(); ++l) {
+      const glm::vec4 light = lights_[l];
+      if (light.w != 0.0f &&
+          glm::length(glm::vec3(light) - sphere.position) - sphere.radius >=
+              ranges_[l]) {
+        continue;
+      }
+      const receiver_t receiver{
+          .center = sphere.position,
+          .radius = sphere.radius,
+          .object = static_cast<uint32_t>(o),
+          .light = light,
+          .range = ranges_[l],
+          .slack = 1e-3f + 1e-6f * sphere.radius};
+
+      // Everything near the rays from the sphere to the light. Cell balls
+      // stick out of the sphere, by less than half of its radius.
+      const glm::vec3 reach_radius(sphere.radius * 1.5f + receiver.slack);
+      glm::vec3 end = glm::vec3(light);
+      if (light.w == 0.0f) {
+        end = sphere.position +
+              glm::normalize(end) *
+                  (glm::length(sphere.position - scene_center_) +
+                   scene_radius_ + reach_radius.x);
+      }
+      aabb_t reach{sphere.position - reach_radius,
+                   sphere.position + reach_radius};
+      reach.grow(aabb_t{end - reach_radius, end + reach_radius});
+      near.clear();
+      geometry.bvh().for_each_overlapping(reach, [&](size_t i) {
+        if (i != o) {
+          near.push_back(static_cast<uint32_t>(i));
+        }
+      });
+      near.insert(near.end(), instances.begin(), instances.end());
+
+      roots_[o * lights_.size() + l] = static_cast<uint32_t>(nodes_.size());
+      build_tree(receiver, near);
+    }
+  }
+}
+
+void visibility_cache_t::build_tree(const receiver_t &receiver,
+                                    std::span<const uint32_t> near) {
+  const auto first = nodes_.size();
+  nodes_.resize(first + 6);
+  for (int face = 0; face < 6; ++face) {
+    const uint32_t node =
+        build_cell(receiver, face, glm::vec2(-1.0f), 2.0f, 0, near);
+    nodes_[first + static_cast<size_t>(face)] = node;
+  }
+}
+
+uint32_t visibility_cache_t::build_cell(const receiver_t &receiver, int face,
+                                        glm::vec2 corner, float size,
+                                        int depth,
+                                        std::span<const uint32_t> candidates) {
+  // Cube map cells have great circle edges: the farthest point from the
+  // center direction is a corner. The cap of that angle fits into a ball.
+  // The angle is taken from the chord, acos() of a dot product can't tell
+  // the cells of a large sphere apart.
+  const glm::vec3 middle =
+      face_direction(face, corner + glm::vec2(size * 0.5f));
+  float chord = 0.0f;
+  for (int c = 0; c < 4; ++c) {
+    const glm::vec2 p = corner + glm::vec2(c & 1, c >> 1) * size;
+    chord = std::max(chord, glm::length(middle - face_direction(face, p)));
+  }
+  const float angle = 2.0f * std::asin(std::min(1.0f, chord * 0.5f));
+  const float cos_angle = std::cos(angle);
+
+  // Points facing away from the light are never looked up, see lookup().
+  const bool directional = receiver.light.w == 0.0f;
+  const glm::vec3 axis = directional
+                             ? glm::vec3(receiver.light)
+                             : glm::vec3(receiver.light) - receiver.center;
+  const float axis_length = glm::length(axis);
+  const float away = std::acos(
+      std::clamp(glm::dot(middle, axis) / axis_length, -1.0f, 1.0f));
+  const float closest = std::cos(std::max(0.0f, away - angle));
+  if (directional ? closest <= 0.0f
+                  : axis_length * closest <= receiver.radius) {
+    return unknown;
+  }
+
+  const float sin_angle = std::sin(angle);
+  const glm::vec3 ball =
+      receiver.center + middle * (receiver.radius * cos_angle);
+  const float ball_radius = receiver.radius * sin_angle + receiver.slack;
+  const float slack = receiver.slack;
+
+  const glm::vec3 to_light = directional
+                                 ? glm::normalize(glm::vec3(receiver.light))
+                                 : glm::vec3(0.0f);
+  // Directional rays end where no occluder can be anymore.
+  const glm::vec3 light =
+      directional ? ball + to_light * (glm::length(ball - scene_center_) +
+                                       scene_radius_ + ball_radius)
+                  : glm::vec3(receiver.light);
+  // Nor are points out of the light's range, it doesn't shade them.
+  if (glm::length(light - ball) - ball_radius >= receiver.range) {
+    return unknown;
+  }
+
+  // Traced shadow rays ignore hits closer than 0.001 of their length.
+  const float ray_length = directional
+                               ? glm::length(glm::vec3(receiver.light))
+                               : glm::length(light - ball) + ball_radius;
+  const float near_limit = 0.001f * ray_length;
+
+  // Does the occluder block every ray from the ball to the light?
+  const auto covers = [&](const occluder_t &occluder) {
+    if (occluder.object == no_object ||
+        glm::length(occluder.center - ball) <=
+            ball_radius + occluder.radius + slack + near_limit) {
+      return false;
+    }
+    if (directional) {
+      const glm::vec3 w = occluder.center - ball;
+      const float along = glm::dot(w, to_light);
+      const float across = glm::length(w - to_light * along);
+      return along > ball_radius + slack &&
+             across + ball_radius + slack < occluder.radius;
+    }
+    const glm::vec3 to_ball = ball - light;
+    const glm::vec3 to_occluder = occluder.center - light;
+    const float ball_distance = glm::length(to_ball);
+    const float occluder_distance = glm::length(to_occluder);
+    if (occluder_distance <= occluder.radius + slack ||
+        occluder_distance + slack >= ball_distance - ball_radius) {
+      return false;
+    }
+    const float between =
+        std::atan2(glm::length(glm::cross(to_ball, to_occluder)),
+                   glm::dot(to_ball, to_occluder));
+    const float ball_angle =
+        std::asin(std::min(1.0f, ball_radius / ball_distance));
+    const float occluder_angle = std::asin(occluder.radius / occluder_distance);
+    return between + ball_angle + 1e-4f < occluder_angle;
+  };
+
+  std::vector<uint32_t> near;
+  for (const uint32_t i : candidates) {
+    const occluder_t &occluder = occluders_[i];
+    if (distance_to_segment(occluder.center, ball, light) >=
+        ball_radius + occluder.radius + slack) {
+      continue;
+    }
+    if (covers(occluder)) {
+      return occluded | occluder.object << 2;
+    }
+    near.push_back(i);
+  }
+  if (near.empty()) {
+    return lit;
+  }
+  if (depth == max_depth || receiver.radius * angle < min_cell_) {
+    return unknown;
+  }
+
+  const auto first = static_cast<uint32_t>(nodes_.size());
+  nodes_.resize(nodes_.size() + 4);
+  const float half = size * 0.5f;
+  for (uint32_t q = 0; q < 4; ++q) {
+    const glm::vec2 child =
+        corner + glm::vec2(static_cast<float>(q & 1),
+                           static_cast<float>(q >> 1)) *
+                     half;
+    const uint32_t node =
+        build_cell(receiver, face, child, half, depth + 1, near);
+    nodes_[first + q] = node;
+  }
+  return inner | first << 2;
+}
+
+visibility_cache_t::visibility_t
+visibility_cache_t::lookup(size_t object, size_t light, glm::vec3 normal,
+                           glm::vec3 light_ray) const noexcept {
+  if (glm::dot(normal, light_ray) <= 0.0f || is_moved_[object]) {
+    return visibility_t::unknown;
+  }
+  const uint32_t root = roots_[object * lights_.size() + light];
+  if (root == no_tree) {
+    return visibility_t::unknown;
+  }
+
+  const auto [face, p] = face_of(normal);
+  uint32_t node = nodes_[root + static_cast<uint32_t>(face)];
+  glm::vec2 corner(-1.0f);
+  float size = 2.0f;
+  while ((node & 3) == inner) {
+    size *= 0.5f;
+    const glm::vec2 middle = corner + size;
+    uint32_t q = 0;
+    if (p.x >= middle.x) {
+      q |= 1;
+      corner.x = middle.x;
+    }
+    if (p.y >= middle.y) {
+      q |= 2;
+      corner.y = middle.y;
+    }
+    node = nodes_[(node >> 2) + q];
+  }
+
+  switch (node & 3) {
+  case lit:
+    if (instances_moved_) {
+      return visibility_t::unknown;
+    }
+    return moved_.empty() ? visibility_t::lit : visibility_t::lit_unless_moved;
+  case occluded:
+    return is_moved_[node >> 2] ? visibility_t::unknown
+                                : visibility_t::occluded;
+  default:
+    return visibility_t::unknown;
+  }
+}
+
+} // namespace soft_render
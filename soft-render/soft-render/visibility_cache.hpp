@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <soft-render/geometry_store.hpp>
+#include <soft-render/scene.hpp>
+
+namespace soft_render {
+
+/**
+ * Shadows of static lights on the scene spheres, traced once and looked up
+ * every frame instead of a shadow ray.
+ *
+ * For every sphere and every light that reaches it, the surface is split by a
+ * cube map into quadtree cells. A cell is a leaf once it's provably lit (no
+ * object comes near the rays from the cell to the light) or provably occluded
+ * (a single sphere covers all of them). The cells in between are subdivided
+ * down to min_cell_ratio of the smallest sphere; those are left at shadow
+ * boundaries, and the points in them trace a ray. Cells facing away from the
+ * light or out of its range are never asked and never split. The proofs are
+ * conservative, so a lookup never disagrees with the ray it replaces.
+ *
+ * Objects moved after the build don't invalidate the cache: a moved receiver
+ * traces its rays, shadows of a moved occluder are traced, and rays of lit
+ * points are tested against the moved objects only. Changed lights, a changed
+ * topology or more than max_moved_tests moved objects rebuild it. Instances
+ * are occluders but not receivers, and once any of them moves, only the
+ * occluded answers stay valid.
+ *
+ * Lights are numbered like the kernel visits them: point lights, then the
+ * bounded ones, then the directional ones.
+ */
+class visibility_cache_t {
+public:
+  enum class visibility_t : uint8_t {
+    /// Nothing blocks the light.
+    lit,
+    /// A sphere blocks it.
+    occluded,
+    /// Nothing that kept its place blocks it, the moved objects may.
+    lit_unless_moved,
+    /// Not cached, trace the ray.
+    unknown,
+  };
+
+  /// Cells stop subdividing at this fraction of the smallest sphere radius.
+  static constexpr float min_cell_ratio = 1.0f / 8.0f;
+  static constexpr int max_depth = 24;
+  /// Lit points test this many moved objects at most. With more of them, a
+  /// ray traced through the BVH is cheaper, sync() rebuilds the cache.
+  static constexpr size_t max_moved_tests = 16;
+
+  /**
+   * Brings the cache up to date with the scene, a rebuild if the lights or
+   * the topology changed. `geometry` must be synced with the scene.
+   */
+  void sync(const scene_t &scene, const geometry_store_t &geometry,
+            std::span<const point_light_t> point,
+            std::span<const point_light_t> bounded,
+            std::span<const directional_light_t> directional);
+
+  /**
+   * @param object - the receiver, an index into scene_t::objects.
+   * @param normal - the unit normal of the shaded point.
+   * @param light_ray - from the point to the light, it's only tested for
+   * facing the light: the light ray of a point on the far side goes through
+   * its own sphere.
+   */
+  [[nodiscard]] visibility_t lookup(size_t object, size_t light,
+                                    glm::vec3 normal,
+                                    glm::vec3 light_ray) const noexcept;
+
+  /// Objects moved since the build, lit_unless_moved() tests them.
+  [[nodiscard]] std::span<const uint32_t> moved() const noexcept {
+    return moved_;
+  }
+
+  /// Quadtree nodes of all the trees, for statistics.
+  [[nodiscard]] size_t size() const noexcept { return nodes_.size(); }
+  /// Builds done so far.
+  [[nodiscard]] size_t builds() const noexcept { return builds_; }
+
+private:
+  /// A node is a leaf kind in the low 2 bits and a payload above them.
+  enum kind_t : uint32_t { inner, lit, unknown, occluded };
+  static constexpr uint32_t no_tree = ~uint32_t{0};
+
+  struct occluder_t {
+    glm::vec3 center;
+    float radius;
+    /// Index into scene_t::objects, no_object for an instance's bounds.
+    uint32_t object;
+  };
+  static constexpr uint32_t no_object = ~uint32_t{0};
+
+  struct receiver_t;
+
+  void build(const scene_t &scene, const geometry_store_t &geometry);
+  void build_tree(const receiver_t &receiver, std::span<const uint32_t> near);
+  [[nodiscard]] uint32_t build_cell(const receiver_t &receiver, int face,
+                                    glm::vec2 corner, float size, int depth,
+                                    std::span<const uint32_t> candidates);
+
+  /// Point lights as (position, 1), directional ones as (direction, 0).
+  std::vector<glm::vec4> lights_;
+  /// Ranges of the lights, infinity if they have none.
+  std::vector<float> ranges_;
+  std::vector<occluder_t> occluders_;
+  /// Six cube faces per (object, light) pair, or no_tree.
+  std::vector<uint32_t> roots_;
+  std::vector<uint32_t> nodes_;
+  float min_cell_ = 0.0f;
+  /// World bounds of the occluders, directional rays end beyond them.
+  glm::vec3 scene_center_ = glm::vec3(0.0f);
+  float scene_radius_ = 0.0f;
+
+  /// scene_t::generation() of the synced scene, 0 for none.
+  uint64_t generation_ = 0;
+  size_t object_count_ = 0;
+  uint64_t revision_ = 0;
+  uint64_t instance_revision_ = 0;
+  bool instances_moved_ = false;
+  std::vector<bool> is_moved_;
+  std::vector<uint32_t> moved_;
+  size_t builds_ = 0;
+};
+
+} // namespace soft_render
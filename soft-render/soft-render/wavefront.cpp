@@ -0,0 +1,702 @@
+#include "wavefront.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <soft-render/bvh.hpp>
+#include <soft-render/geometry.hpp>
+#include <soft-render/geometry_store.hpp>
+
+namespace soft_render {
+
+namespace {
+
+/// Three float arrays instead of an array of glm::vec3.
+struct vec3_array_t {
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> z;
+
+  void resize(size_t size) {
+    x.resize(size);
+    y.resize(size);
+    z.resize(size);
+  }
+
+  [[nodiscard]] glm::vec3 operator[](size_t i) const noexcept {
+    return {x[i], y[i], z[i]};
+  }
+
+  void set(size_t i, glm::vec3 value) noexcept {
+    x[i] = value.x;
+    y[i] = value.y;
+    z[i] = value.z;
+  }
+};
+
+/**
+ * Lanes of a packet: the primary rays of a tile row, or as many points of a
+ * shading batch. Loops over the lanes of a packet have a known trip count, so
+ * they vectorize even where a loop over a whole batch doesn't (GCC at -O2
+ * never versions a loop for aliasing). The lanes live on the stack, so nothing
+ * they are computed from aliases them.
+ */
+constexpr size_t packet_size = tile_bins_t::tile_size;
+
+using lanes_t = std::array<float, packet_size>;
+
+/// `size` rounded up to whole packets.
+constexpr size_t packet_capacity(size_t size) noexcept {
+  return (size + packet_size - 1) / packet_size * packet_size;
+}
+
+struct vec3_lanes_t {
+  lanes_t x;
+  lanes_t y;
+  lanes_t z;
+
+  /// Elements [first, first + packet_size) of `from`.
+  void load(const vec3_array_t &from, size_t first) noexcept {
+    for (size_t l = 0; l < packet_size; ++l) {
+      x[l] = from.x[first + l];
+      y[l] = from.y[first + l];
+      z[l] = from.z[first + l];
+    }
+  }
+
+  void store(vec3_array_t &to, size_t first) const noexcept {
+    for (size_t l = 0; l < packet_size; ++l) {
+      to.x[first + l] = x[l];
+      to.y[first + l] = y[l];
+      to.z[first + l] = z[l];
+    }
+  }
+};
+
+/// glm::dot() of every lane, in its order of the terms.
+[[nodiscard]] lanes_t dot(const vec3_lanes_t &a,
+                          const vec3_lanes_t &b) noexcept {
+  lanes_t result;
+  for (size_t l = 0; l < packet_size; ++l) {
+    result[l] = a.x[l] * b.x[l] + a.y[l] * b.y[l] + a.z[l] * b.z[l];
+  }
+  return result;
+}
+
+/// Rays of one bounce. `path` is the pixel in the row the ray belongs to.
+struct ray_batch_t {
+  vec3_array_t origin;
+  vec3_array_t direction;
+  std::vector<uint32_t> path;
+  size_t size = 0;
+
+  void reset(size_t capacity) {
+    origin.resize(capacity);
+    direction.resize(capacity);
+    path.resize(capacity);
+    size = 0;
+  }
+
+  void push(uint32_t pixel, glm::vec3 from, glm::vec3 to) noexcept {
+    origin.set(size, from);
+    direction.set(size, to);
+    path[size] = pixel;
+    ++size;
+  }
+};
+
+/// Closest hits of a ray batch, parallel to it.
+struct hit_buffer_t {
+  /// Index into the material table.
+  std::vector<uint32_t> material;
+  std::vector<float> t;
+  vec3_array_t point;
+  vec3_array_t normal;
+
+  static constexpr uint32_t no_hit = std::numeric_limits<uint32_t>::max();
+
+  void reset(size_t capacity) {
+    material.resize(capacity);
+    t.resize(capacity);
+    point.resize(capacity);
+    normal.resize(capacity);
+  }
+};
+
+/// Hits compacted and sorted by material, the shading stages work on it.
+struct shading_batch_t {
+  std::vector<uint32_t> material;
+  std::vector<uint32_t> path;
+  vec3_array_t point;
+  vec3_array_t normal;
+  /// -ray.direction, the "view vector" of the specular term.
+  vec3_array_t to_camera;
+  /// to_camera normalized, for the fast math only.
+  vec3_array_t view;
+  std::vector<float> intensity;
+
+  /// The shadow ray batch of the current light.
+  vec3_array_t light_ray;
+  std::vector<float> attenuation;
+  /// What the light adds to the point if nothing blocks it.
+  std::vector<float> contribution;
+  std::vector<uint8_t> lit;
+
+  /// Scratch for the sort by material: material << 32 | hit index.
+  std::vector<uint64_t> order;
+  size_t size = 0;
+
+  /// Whole packets: the shading loops run over the lanes past `size` too.
+  void reset(size_t rays) {
+    const size_t capacity = packet_capacity(rays);
+    material.resize(capacity);
+    path.resize(capacity);
+    point.resize(capacity);
+    normal.resize(capacity);
+    to_camera.resize(capacity);
+    view.resize(capacity);
+    intensity.resize(capacity);
+    light_ray.resize(capacity);
+    attenuation.resize(capacity);
+    contribution.resize(capacity);
+    lit.resize(capacity);
+    order.resize(capacity);
+    size = 0;
+  }
+};
+
+/// What a path got at one bounce, trace_ray() locals kept for the resolve.
+struct bounce_records_t {
+  enum state_t : uint8_t {
+    /// No ray reached this bounce.
+    none,
+    miss,
+    hit,
+  };
+
+  std::vector<uint8_t> state;
+  std::vector<mfb_color> local_color;
+  std::vector<float> reflective;
+
+  void reset(size_t paths) {
+    state.assign(paths, none);
+    local_color.resize(paths);
+    reflective.resize(paths);
+  }
+};
+
+/// Per-thread scratch, reused by every row the thread renders.
+struct wavefront_state_t {
+  std::array<ray_batch_t, 2> rays;
+  hit_buffer_t hits;
+  shading_batch_t shading;
+  std::array<bounce_records_t, max_trace_depth + 1> bounces;
+};
+
+/// Stores the hit of ray i of the batch, or its miss.
+void record_hit(const prepared_scene_t &prepared, const ray_t &ray,
+                const hit_t &hit, size_t i, hit_buffer_t &hits) {
+  if (!hit) {
+    hits.material[i] = hit_buffer_t::no_hit;
+    return;
+  }
+
+  const glm::vec3 point = ray.at(hit.t);
+  hits.material[i] = prepared.materials.id(hit);
+  hits.t[i] = hit.t;
+  hits.point.set(i, point);
+  hits.normal.set(i, prepared.geometry.normal_at(hit, point));
+}
+
+/// Reflection rays: every one goes through the BVH on its own.
+void intersect(const prepared_scene_t &prepared, const ray_batch_t &rays,
+               float t_min, hit_buffer_t &hits) {
+  for (size_t i = 0; i < rays.size; ++i) {
+    const ray_t ray(rays.origin[i], rays.direction[i]);
+    record_hit(prepared, ray,
+               closest_intersection(prepared.geometry, ray, t_min,
+                                    std::numeric_limits<float>::infinity()),
+               i, hits);
+  }
+}
+
+/**
+ * Closest hits of a packet of primary rays, the `count` rays from `first`,
+ * with the tile's list. It's intersect_ray_sphere() turned around: the rays
+ * share the camera, so the sphere terms are computed once per sphere and the
+ * ray terms are lanes. Most spheres of a list miss the whole packet, that's
+ * found out without a sqrt; the roots are taken for the lanes that hit only.
+ * The arithmetic is the one of intersect_ray_sphere(), so are the hits.
+ */
+void intersect_packet(const geometry_store_t &store,
+                      std::span<const uint32_t> objects,
+                      const ray_batch_t &rays, size_t first, size_t count,
+                      float t_min, std::span<hit_t, packet_size> packet) {
+  // NaN in the lanes past `count`: their discriminant is never >= 0.
+  lanes_t a;
+  a.fill(std::numeric_limits<float>::quiet_NaN());
+  vec3_lanes_t direction{};
+  lanes_t inv_a{};
+  for (size_t l = 0; l < count; ++l) {
+    const ray_t ray(rays.origin[first + l], rays.direction[first + l]);
+    direction.x[l] = ray.direction.x;
+    direction.y[l] = ray.direction.y;
+    direction.z[l] = ray.direction.z;
+    a[l] = ray.a;
+    inv_a[l] = ray.inv_a;
+  }
+
+  const glm::vec3 origin = rays.origin[first];
+  const auto &spheres = store.spheres();
+  std::ranges::fill(packet, hit_t{});
+  for (const uint32_t object : objects) {
+    const sphere_geometry_t &sphere = spheres[object];
+    const glm::vec3 CO = origin - sphere.position;
+    const float c = glm::dot(CO, CO) - sphere.radius2;
+
+    lanes_t half_b;
+    lanes_t discriminant;
+    int hit_lanes = 0;
+    for (size_t l = 0; l < packet_size; ++l) {
+      half_b[l] = CO.x * direction.x[l] + CO.y * direction.y[l] +
+                  CO.z * direction.z[l];
+      discriminant[l] = half_b[l] * half_b[l] - a[l] * c;
+      hit_lanes += discriminant[l] >= 0 ? 1 : 0;
+    }
+    if (hit_lanes == 0) {
+      continue;
+    }
+
+    for (size_t l = 0; l < count; ++l) {
+      if (discriminant[l] < 0) {
+        continue;
+      }
+      const float root = std::sqrt(discriminant[l]);
+      const float t1 = (-half_b[l] + root) * inv_a[l];
+      const float t2 = (-half_b[l] - root) * inv_a[l];
+      hit_t &hit = packet[l];
+      if (t1 >= t_min && t1 < hit.t) {
+        hit = {.object = object, .t = t1};
+      }
+      if (t2 >= t_min && t2 < hit.t) {
+        hit = {.object = object, .t = t2};
+      }
+    }
+  }
+}
+
+/**
+ * Primary rays, the row from the column `first`: a packet per tile it
+ * crosses. Tiles with too many objects for a list go through the BVH a ray
+ * at a time, the same as closest_primary_intersection() does.
+ */
+void intersect_primary(const prepared_scene_t &prepared,
+                       const ray_batch_t &rays, const tile_bins_t &tiles,
+                       size_t first, size_t j, float t_min,
+                       hit_buffer_t &hits) {
+  const geometry_store_t &store = prepared.geometry;
+  std::array<hit_t, packet_size> packet;
+  for (size_t begin = 0; begin < rays.size;) {
+    // Primary rays are pushed in the column order.
+    const size_t column = first + begin;
+    const size_t count = std::min(packet_size - column % packet_size,
+                                  rays.size - begin);
+    const auto objects = tiles.objects_at(column, j);
+    if (objects) {
+      intersect_packet(store, *objects, rays, begin, count, t_min, packet);
+    }
+
+    for (size_t l = 0; l < count; ++l) {
+      const ray_t ray(rays.origin[begin + l], rays.direction[begin + l]);
+      hit_t &hit = packet[l];
+      if (!objects) {
+        hit = closest_intersection(store, ray, t_min,
+                                   std::numeric_limits<float>::infinity());
+      } else if (!store.instances().empty()) {
+        float t_max = hit.t;
+        closest_instance_hit(store, ray, t_min, t_max, hit);
+      }
+      record_hit(prepared, ray, hit, begin + l, hits);
+    }
+    begin += count;
+  }
+}
+
+/**
+ * Compacts the hits into the shading batch, grouped by material, so the
+ * shading loops read the same material over long runs. Misses are recorded
+ * right away, they need no shading.
+ */
+void sort_by_material(const ray_batch_t &rays, const hit_buffer_t &hits,
+                      shading_batch_t &batch, bounce_records_t &records) {
+  batch.size = 0;
+  for (size_t i = 0; i < rays.size; ++i) {
+    if (hits.material[i] == hit_buffer_t::no_hit) {
+      records.state[rays.path[i]] = bounce_records_t::miss;
+    } else {
+      batch.order[batch.size++] =
+          static_cast<uint64_t>(hits.material[i]) << 32 | i;
+    }
+  }
+
+  // Keys are unique, so it's deterministic without a (allocating) stable
+  // sort, and rays of one material keep their order.
+  const auto order = std::span(batch.order).first(batch.size);
+  std::sort(order.begin(), order.end());
+
+  for (size_t n = 0; n < batch.size; ++n) {
+    const auto i = static_cast<uint32_t>(order[n]);
+    batch.material[n] = hits.material[i];
+    batch.path[n] = rays.path[i];
+    batch.point.set(n, hits.point[i]);
+    batch.normal.set(n, hits.normal[i]);
+    batch.to_camera.set(n, -rays.direction[i]);
+  }
+}
+
+/**
+ * Traces the shadow ray batch of one light, `lit` is 0 for occluded points.
+ * Points the light doesn't reach anyway get no shadow ray.
+ *
+ * @param light - the light's number, see visibility_cache_t.
+ */
+void trace_shadows(const prepared_scene_t &prepared, shading_batch_t &batch,
+                   size_t light, float t_max) {
+  for (size_t n = 0; n < batch.size; ++n) {
+    batch.lit[n] = batch.contribution[n] >= min_light_contribution &&
+                   !shadowed(prepared, batch.material[n], light,
+                             batch.point[n], batch.normal[n],
+                             batch.light_ray[n], t_max);
+  }
+}
+
+/// Elements [first, first + packet_size) of `from`.
+[[nodiscard]] lanes_t load(const std::vector<float> &from,
+                           size_t first) noexcept {
+  lanes_t lanes;
+  for (size_t l = 0; l < packet_size; ++l) {
+    lanes[l] = from[first + l];
+  }
+  return lanes;
+}
+
+void store(const lanes_t &lanes, std::vector<float> &to,
+           size_t first) noexcept {
+  for (size_t l = 0; l < packet_size; ++l) {
+    to[first + l] = lanes[l];
+  }
+}
+
+/**
+ * light_contribution() of the fast math for every point of the batch, a
+ * packet at a time. Only the highlight table is read a lane at a time: the
+ * exponent is the material's.
+ */
+template <trace_features_t Features>
+void fast_light_contributions(const prepared_scene_t &prepared,
+                              shading_batch_t &batch, float light_intensity) {
+  for (size_t first = 0; first < batch.size; first += packet_size) {
+    vec3_lanes_t normal;
+    vec3_lanes_t light_ray;
+    normal.load(batch.normal, first);
+    light_ray.load(batch.light_ray, first);
+    const lanes_t length2 = dot(light_ray, light_ray);
+    const lanes_t n_dot_light = dot(normal, light_ray);
+
+    lanes_t inv_length;
+    lanes_t n_dot_l;
+    lanes_t contribution;
+    for (size_t l = 0; l < packet_size; ++l) {
+      inv_length[l] = fast_rsqrt(length2[l]);
+      n_dot_l[l] = n_dot_light[l] * inv_length[l];
+      contribution[l] = std::max(light_intensity * n_dot_l[l], 0.0f);
+    }
+
+    if constexpr (Features.specular) {
+      vec3_lanes_t view;
+      view.load(batch.view, first);
+      lanes_t r_dot_v;
+      for (size_t l = 0; l < packet_size; ++l) {
+        const float rx =
+            normal.x[l] * (2.0f * n_dot_l[l]) - light_ray.x[l] * inv_length[l];
+        const float ry =
+            normal.y[l] * (2.0f * n_dot_l[l]) - light_ray.y[l] * inv_length[l];
+        const float rz =
+            normal.z[l] * (2.0f * n_dot_l[l]) - light_ray.z[l] * inv_length[l];
+        r_dot_v[l] = rx * view.x[l] + ry * view.y[l] + rz * view.z[l];
+      }
+
+      const size_t count = std::min(packet_size, batch.size - first);
+      for (size_t l = 0; l < count; ++l) {
+        const highlight_table_t *highlight =
+            prepared.materials.highlight(batch.material[first + l]);
+        if (highlight != nullptr) {
+          contribution[l] += light_intensity * (*highlight)(r_dot_v[l]);
+        }
+      }
+    }
+    store(contribution, batch.contribution, first);
+  }
+}
+
+/**
+ * Adds one light to every point of the batch. The terms are the ones of
+ * compute_lightning() in the same order, so both pipelines produce the same
+ * picture.
+ *
+ * @param light - the light's number, see visibility_cache_t.
+ * @param attenuated - take the falloff from `batch.attenuation`.
+ */
+template <trace_features_t Features>
+void shade_light(const prepared_scene_t &prepared, shading_batch_t &batch,
+                 size_t light, float light_intensity, float t_max,
+                 bool attenuated) {
+  if constexpr (Features.fast_math) {
+    fast_light_contributions<Features>(prepared, batch, light_intensity);
+  } else {
+    // The exact math calls std::pow() and std::sqrt(), a point at a time.
+    const auto &materials = prepared.materials.materials;
+    for (size_t n = 0; n < batch.size; ++n) {
+      batch.contribution[n] = light_contribution<Features>(
+          batch.normal[n], batch.light_ray[n], batch.to_camera[n],
+          light_intensity, materials[batch.material[n]].specular, nullptr);
+    }
+  }
+  if (attenuated) {
+    for (size_t first = 0; first < batch.size; first += packet_size) {
+      lanes_t contribution = load(batch.contribution, first);
+      const lanes_t attenuation = load(batch.attenuation, first);
+      for (size_t l = 0; l < packet_size; ++l) {
+        contribution[l] *= attenuation[l];
+      }
+      store(contribution, batch.contribution, first);
+    }
+  }
+
+  if constexpr (Features.shadows) {
+    trace_shadows(prepared, batch, light, t_max);
+  }
+  for (size_t first = 0; first < batch.size; first += packet_size) {
+    const lanes_t contribution = load(batch.contribution, first);
+    lanes_t intensity = load(batch.intensity, first);
+    for (size_t l = 0; l < packet_size; ++l) {
+      const bool adds = Features.shadows
+                            ? batch.lit[first + l] != 0
+                            : contribution[l] >= min_light_contribution;
+      intensity[l] += adds ? contribution[l] : 0.0f;
+    }
+    store(intensity, batch.intensity, first);
+  }
+}
+
+/// Fills the light rays of the batch for a point light.
+void point_light_rays(const point_light_t &light, shading_batch_t &batch) {
+  for (size_t first = 0; first < batch.size; first += packet_size) {
+    vec3_lanes_t point;
+    point.load(batch.point, first);
+    vec3_lanes_t light_ray;
+    for (size_t l = 0; l < packet_size; ++l) {
+      light_ray.x[l] = light.position.x - point.x[l];
+      light_ray.y[l] = light.position.y - point.y[l];
+      light_ray.z[l] = light.position.z - point.z[l];
+    }
+    light_ray.store(batch.light_ray, first);
+  }
+}
+
+template <trace_features_t Features>
+void shade(const prepared_scene_t &prepared, shading_batch_t &batch,
+           bounce_records_t &records) {
+  std::fill_n(batch.intensity.begin(), batch.size, prepared.lights.ambient);
+  if constexpr (Features.fast_math) {
+    for (size_t first = 0; first < batch.size; first += packet_size) {
+      vec3_lanes_t to_camera;
+      to_camera.load(batch.to_camera, first);
+      const lanes_t length2 = dot(to_camera, to_camera);
+      for (size_t l = 0; l < packet_size; ++l) {
+        const float inv_length = fast_rsqrt(length2[l]);
+        to_camera.x[l] *= inv_length;
+        to_camera.y[l] *= inv_length;
+        to_camera.z[l] *= inv_length;
+      }
+      to_camera.store(batch.view, first);
+    }
+  }
+
+  const auto &lights = prepared.lights;
+  for (size_t i = 0; i < lights.point.size(); ++i) {
+    point_light_rays(lights.point[i], batch);
+    shade_light<Features>(prepared, batch, i, lights.point[i].intensity, 1.0f,
+                          false);
+  }
+
+  // Lights with a range: only the ones that reach the batch at all. The
+  // others would add nothing, so the sum is the same as of the grid lookups
+  // in compute_lightning().
+  aabb_t points;
+  for (size_t n = 0; n < batch.size; ++n) {
+    points.grow(batch.point[n]);
+  }
+  const auto &bounded = prepared.lights.bounded;
+  for (size_t i = 0; i < bounded.size() && batch.size != 0; ++i) {
+    const point_light_t &light = bounded[i];
+    const glm::vec3 nearest =
+        glm::clamp(light.position, points.min, points.max);
+    const glm::vec3 to_box = nearest - light.position;
+    if (glm::dot(to_box, to_box) >= light.range * light.range) {
+      continue;
+    }
+
+    point_light_rays(light, batch);
+    for (size_t n = 0; n < batch.size; ++n) {
+      const glm::vec3 light_ray = batch.light_ray[n];
+      batch.attenuation[n] = light.attenuation(glm::dot(light_ray, light_ray));
+    }
+    shade_light<Features>(prepared, batch, lights.point.size() + i,
+                          light.intensity, 1.0f, true);
+  }
+
+  const size_t first_directional = lights.point.size() + bounded.size();
+  for (size_t i = 0; i < lights.directional.size(); ++i) {
+    const directional_light_t &light = lights.directional[i];
+    std::fill_n(batch.light_ray.x.begin(), batch.size, light.direction.x);
+    std::fill_n(batch.light_ray.y.begin(), batch.size, light.direction.y);
+    std::fill_n(batch.light_ray.z.begin(), batch.size, light.direction.z);
+    shade_light<Features>(prepared, batch, first_directional + i,
+                          light.intensity,
+                          std::numeric_limits<float>::infinity(), false);
+  }
+
+  const auto &materials = prepared.materials.materials;
+  for (size_t n = 0; n < batch.size; ++n) {
+    const material_t &material = materials[batch.material[n]];
+    const uint32_t path = batch.path[n];
+    mfb_color local_color = material.color;
+    local_color.set(local_color.as_rgb_vec() *
+                    std::min(batch.intensity[n], 1.0f));
+    records.state[path] = bounce_records_t::hit;
+    records.local_color[path] = local_color;
+    records.reflective[path] = material.reflective;
+  }
+}
+
+/// Emits the reflection ray batch of the next bounce.
+void reflect(const prepared_scene_t &prepared, const shading_batch_t &batch,
+             ray_batch_t &next) {
+  const auto &materials = prepared.materials.materials;
+  next.size = 0;
+  for (size_t n = 0; n < batch.size; ++n) {
+    if (materials[batch.material[n]].reflective <= 0) {
+      continue;
+    }
+    next.push(batch.path[n], batch.point[n],
+              reflect_ray(batch.to_camera[n], batch.normal[n]));
+  }
+}
+
+/**
+ * Blends the bounces of every path from the deepest up, the way trace_ray()
+ * returns from its recursion.
+ */
+void resolve(std::span<const bounce_records_t> bounces,
+             std::span<mfb_color> row, mfb_color background_color) {
+  for (size_t path = 0; path < row.size(); ++path) {
+    mfb_color color = background_color;
+    for (size_t depth = bounces.size(); depth-- > 0;) {
+      const bounce_records_t &records = bounces[depth];
+      if (records.state[path] != bounce_records_t::hit) {
+        // Nothing went deeper, or the ray missed.
+        color = background_color;
+        continue;
+      }
+
+      const mfb_color local_color = records.local_color[path];
+      const bool reflected = depth + 1 < bounces.size() &&
+                             bounces[depth + 1].state[path] !=
+                                 bounce_records_t::none;
+      if (!reflected || color == background_color) {
+        color = local_color;
+        continue;
+      }
+
+      const float reflective = records.reflective[path];
+      color = mfb_color::from_vec3(local_color.as_rgb_vec() * (1 - reflective) +
+                                   color.as_rgb_vec() * reflective);
+    }
+    row[path] = color;
+  }
+}
+
+template <trace_features_t Features>
+void trace_row_wavefront(const prepared_scene_t &prepared,
+                         const camera_setup_t &camera, const tile_bins_t &tiles,
+                         size_t first, size_t j, std::span<mfb_color> row) {
+  thread_local wavefront_state_t state;
+  constexpr int bounces =
+      Features.reflections ? Features.max_depth + 1 : 1;
+
+  ray_batch_t *rays = &state.rays[0];
+  ray_batch_t *next = &state.rays[1];
+  rays->reset(row.size());
+  next->reset(row.size());
+  state.hits.reset(row.size());
+  state.shading.reset(row.size());
+
+  const glm::vec3 row_start = camera.ray(0, j);
+  for (size_t i = 0; i < row.size(); ++i) {
+    rays->push(static_cast<uint32_t>(i), camera.origin,
+               row_start + camera.step_x * static_cast<float>(first + i));
+  }
+
+  const auto records = std::span(state.bounces).first(bounces);
+  for (size_t depth = 0; depth < records.size(); ++depth) {
+    records[depth].reset(row.size());
+  }
+
+  // Primary rays start on the projection plane, reflections on the surface.
+  float t_min = 1.0f;
+  for (size_t depth = 0; depth < records.size() && rays->size != 0;
+       ++depth) {
+    if (depth == 0) {
+      intersect_primary(prepared, *rays, tiles, first, j, t_min, state.hits);
+    } else {
+      intersect(prepared, *rays, t_min, state.hits);
+    }
+    sort_by_material(*rays, state.hits, state.shading, records[depth]);
+    shade<Features>(prepared, state.shading, records[depth]);
+
+    if (depth + 1 < records.size()) {
+      reflect(prepared, state.shading, *next);
+      std::swap(rays, next);
+      t_min = 0.001f;
+    }
+  }
+
+  resolve(records, row, mfb_color{});
+}
+
+template <size_t... I>
+constexpr std::array<row_kernel_t, kernel_count>
+make_wavefront_row_kernels(std::index_sequence<I...>) noexcept {
+  return {&trace_row_wavefront<kernel_features(I)>...};
+}
+
+constexpr auto wavefront_row_kernels =
+    make_wavefront_row_kernels(std::make_index_sequence<kernel_count>());
+
+} // namespace
+
+row_kernel_t select_wavefront_row_kernel(trace_features_t features) {
+  features.max_depth = std::clamp(features.max_depth, 0, max_trace_depth);
+  return wavefront_row_kernels[kernel_index(features)];
+}
+
+} // namespace soft_render
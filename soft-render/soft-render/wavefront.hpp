@@ -0,0 +1,37 @@
+#pragma once
+
+#include <soft-render/kernel.hpp>
+#include <soft-render/render.hpp>
+
+namespace soft_render {
+
+/**
+ * Row kernels of the wavefront pipeline.
+ *
+ * The megakernel (trace_ray) follows one pixel through intersection, shading
+ * and every reflection bounce before it moves to the next pixel. The wavefront
+ * kernel runs each stage for the whole row at once instead:
+ *
+ *   1. intersect: closest hits of a ray batch into a hit buffer (material, t,
+ *      point, normal);
+ *   2. sort: hits are grouped by material and compacted into a shading batch;
+ *   3. shadows: one shadow ray batch per light, traced together;
+ *   4. shade: diffuse and specular terms over the batch;
+ *   5. reflect: the reflection ray batch for the next bounce.
+ *
+ * After the last bounce every pixel is resolved from its bounce records, from
+ * the deepest one up, exactly the way trace_ray() blends them.
+ *
+ * All batches are structures of arrays, processed in packets of a tile's
+ * width. Primary rays of a packet are tested against a sphere of the tile's
+ * list together, and the shading loops of the fast math run a packet at a time
+ * (the exact math calls std::pow() a point at a time). Shadow and reflection
+ * rays are traced one by one through the BVH, as the megakernel does. So the
+ * pipeline wins with the fast math, about 15% on the lights scene, and is on
+ * par with the megakernel otherwise. Each stage is a separate function, so a
+ * profiler shows where a frame spends its time.
+ */
+[[nodiscard]] row_kernel_t
+select_wavefront_row_kernel(trace_features_t features);
+
+} // namespace soft_render
@@ -0,0 +1,169 @@
+#include "worker_topology.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace soft_render {
+
+namespace {
+
+template <typename T>
+[[nodiscard]] bool parse_number(std::string_view value, T &result) {
+  const auto [end, ec] =
+      std::from_chars(value.data(), value.data() + value.size(), result);
+  return ec == std::errc() && end == value.data() + value.size();
+}
+
+[[nodiscard]] size_t hardware_threads() noexcept {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+} // namespace
+
+worker_topology_t worker_topology_t::detect() {
+  // Node directories are node0, node1, ... but the numbers may have gaps.
+  std::vector<std::pair<unsigned, std::filesystem::path>> node_dirs;
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(
+           "/sys/devices/system/node", ec)) {
+    const std::string name = entry.path().filename().string();
+    unsigned number = 0;
+    if (name.starts_with("node") &&
+        parse_number(std::string_view(name).substr(4), number)) {
+      node_dirs.emplace_back(number, entry.path());
+    }
+  }
+  std::sort(node_dirs.begin(), node_dirs.end());
+
+  worker_topology_t topology;
+  for (const auto &[number, dir] : node_dirs) {
+    std::ifstream file(dir / "cpulist");
+    std::string list;
+    if (!file || !std::getline(file, list)) {
+      continue;
+    }
+    auto cpus = parse_cpu_list(list);
+    // Memory-only nodes have no CPUs and get no workers.
+    if (cpus && !cpus->empty()) {
+      const size_t threads = cpus->size();
+      topology.nodes.push_back({.cpus = std::move(*cpus), .threads = threads});
+    }
+  }
+
+  if (topology.nodes.empty()) {
+    return single(hardware_threads());
+  }
+  return topology;
+}
+
+worker_topology_t worker_topology_t::single(size_t threads) {
+  return {.nodes = {{.cpus = {}, .threads = std::max<size_t>(threads, 1)}}};
+}
+
+worker_topology_t worker_topology_t::simulated(size_t nodes,
+                                               size_t threads_per_node) {
+  nodes = std::max<size_t>(nodes, 1);
+  const size_t cpus = hardware_threads();
+  worker_topology_t topology;
+  for (size_t node = 0; node < nodes; ++node) {
+    worker_node_t &n = topology.nodes.emplace_back();
+    n.threads = std::max<size_t>(threads_per_node, 1);
+    // With fewer CPUs than nodes, nodes share CPUs round-robin.
+    const size_t first = node * cpus / nodes;
+    const size_t last = std::max((node + 1) * cpus / nodes, first + 1);
+    for (size_t cpu = first; cpu < last; ++cpu) {
+      n.cpus.push_back(static_cast<unsigned>(cpu % cpus));
+    }
+  }
+  return topology;
+}
+
+size_t worker_topology_t::threads() const noexcept {
+  size_t threads = 0;
+  for (const auto &node : nodes) {
+    threads += node.threads;
+  }
+  return threads;
+}
+
+std::optional<worker_topology_t>
+parse_worker_topology(std::string_view spec) {
+  if (spec == "auto") {
+    return worker_topology_t::detect();
+  }
+
+  size_t threads = 0;
+  const auto x = spec.find('x');
+  if (x == std::string_view::npos) {
+    if (!parse_number(spec, threads) || threads == 0) {
+      return std::nullopt;
+    }
+    return worker_topology_t::single(threads);
+  }
+
+  size_t nodes = 0;
+  if (!parse_number(spec.substr(0, x), nodes) || nodes == 0 ||
+      !parse_number(spec.substr(x + 1), threads) || threads == 0) {
+    return std::nullopt;
+  }
+  return worker_topology_t::simulated(nodes, threads);
+}
+
+std::optional<std::vector<unsigned>> parse_cpu_list(std::string_view list) {
+  std::vector<unsigned> cpus;
+  while (!list.empty() && (list.back() == '\n' || list.back() == ' ')) {
+    list.remove_suffix(1);
+  }
+  while (!list.empty()) {
+    const auto comma = list.find(',');
+    const std::string_view range = list.substr(0, comma);
+    list = comma == std::string_view::npos ? std::string_view()
+                                           : list.substr(comma + 1);
+
+    unsigned first = 0;
+    unsigned last = 0;
+    const auto dash = range.find('-');
+    if (dash == std::string_view::npos) {
+      if (!parse_number(range, first)) {
+        return std::nullopt;
+      }
+      last = first;
+    } else if (!parse_number(range.substr(0, dash), first) ||
+               !parse_number(range.substr(dash + 1), last) || last < first) {
+      return std::nullopt;
+    }
+    for (unsigned cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+bool pin_current_thread(std::span<const unsigned> cpus) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const unsigned cpu : cpus) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+} // namespace soft_render
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace soft_render {
+
+/**
+ * Workers of one NUMA node. They are pinned to the node's CPUs, so they
+ * don't migrate to another socket and the memory they first touch stays
+ * local to them.
+ */
+struct worker_node_t {
+  /// CPUs the workers may run on. Empty: no pinning.
+  std::vector<unsigned> cpus;
+  size_t threads = 1;
+};
+
+/**
+ * How the renderer's worker threads are laid out over the machine. Each node
+ * gets its own thread pool, its own copy of the per-frame scene data and a
+ * contiguous band of rows of every view.
+ */
+struct worker_topology_t {
+  std::vector<worker_node_t> nodes;
+
+  /// The machine's NUMA nodes, a thread per CPU. One unpinned node if the
+  /// layout is unknown.
+  [[nodiscard]] static worker_topology_t detect();
+
+  /// One node with `threads` unpinned workers.
+  [[nodiscard]] static worker_topology_t single(size_t threads);
+
+  /**
+   * Pretends the machine has `nodes` NUMA nodes: its CPUs are split evenly
+   * between them. It exercises the multi-node paths (pinning, row bands,
+   * per-node scene copies) on a single-socket box.
+   */
+  [[nodiscard]] static worker_topology_t simulated(size_t nodes,
+                                                   size_t threads_per_node);
+
+  [[nodiscard]] size_t threads() const noexcept;
+
+  /// @return the node that owns row `j` of a view `rows` high.
+  [[nodiscard]] size_t node_of_row(size_t j, size_t rows) const noexcept {
+    return j * nodes.size() / rows;
+  }
+
+  /// @return the first row of the node's band of a view `rows` high.
+  [[nodiscard]] size_t first_row(size_t node, size_t rows) const noexcept {
+    return (node * rows + nodes.size() - 1) / nodes.size();
+  }
+};
+
+/**
+ * Parses a topology spec:
+ *   auto          detect()
+ *   <n>           single(n)
+ *   <nodes>x<n>   simulated(nodes, n)
+ *
+ * @return nullopt if the spec is invalid.
+ */
+[[nodiscard]] std::optional<worker_topology_t>
+parse_worker_topology(std::string_view spec);
+
+/**
+ * Parses a Linux CPU list, e.g. "0-3,8,10-11".
+ *
+ * @return nullopt if the list is invalid.
+ */
+[[nodiscard]] std::optional<std::vector<unsigned>>
+parse_cpu_list(std::string_view list);
+
+/**
+ * Restricts the calling thread to the CPUs.
+ *
+ * @return false if the platform doesn't support it or it failed.
+ */
+bool pin_current_thread(std::span<const unsigned> cpus);
+
+} // namespace soft_render
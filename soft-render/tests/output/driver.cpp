@@ -0,0 +1,149 @@
+// Tests of the frame output, see the testscript.
+//
+// Usage: driver <format>
+//        driver --slow-sink
+//
+// With a format, encodes a tiny fixed image and dumps the bytes as hex, 16
+// per line, for the testscript to compare against the known encoding.
+//
+// With --slow-sink, streams frames into a pipe that isn't read at first:
+// submit() must block once max_pending_frames frames are in flight, then all
+// of them must arrive in order.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include <soft-render/mfb_color.hpp>
+#include <soft-render/output.hpp>
+
+using namespace soft_render;
+
+namespace {
+
+constexpr mfb_color rgb(uint8_t r, uint8_t g, uint8_t b) {
+  return {.b = b, .g = g, .r = r, .a = 255};
+}
+
+/// 3x2, top-down. Every QOI op but rgba shows up: diff, run, rgb, index and
+/// luma twice.
+const std::vector<mfb_color> image = {
+    rgb(255, 0, 0), rgb(255, 0, 0), rgb(128, 128, 128),
+    rgb(255, 0, 0), rgb(1, 255, 1), rgb(3, 250, 1),
+};
+constexpr size_t width = 3;
+constexpr size_t height = 2;
+
+void dump(std::span<const uint8_t> bytes) {
+  std::string line;
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    line += fmt::format("{}{:02x}", line.empty() ? "" : " ", bytes[i]);
+    if (i % 16 == 15 || i + 1 == bytes.size()) {
+      fmt::println("{}", line);
+      line.clear();
+    }
+  }
+}
+
+void slow_sink() {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    throw std::runtime_error("unable to create a pipe");
+  }
+  std::FILE *sink = fdopen(fds[1], "wb");
+
+  // A frame is larger than a pipe buffer: the writer blocks on the first one.
+  constexpr size_t side = 256;
+  constexpr size_t frame_size = side * side * 4;
+  constexpr size_t frames = 8;
+  const frame_output_options_t options = {.format = image_format_t::bgra,
+                                          .destination = "-",
+                                          .stream = sink,
+                                          .encoder_threads = 2,
+                                          .max_pending_frames = 2};
+  std::atomic<size_t> submitted = 0;
+  size_t stalled_at = 0;
+  std::vector<uint8_t> received(frames * frame_size);
+  {
+    frame_output output(options);
+    std::thread producer([&] {
+      for (size_t i = 0; i < frames; ++i) {
+        output.submit(std::vector<mfb_color>(side * side,
+                                             rgb(static_cast<uint8_t>(i), 0,
+                                                 0)),
+                      side, side);
+        ++submitted;
+      }
+    });
+    // Enough for the encoders to finish every frame they were given.
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    stalled_at = submitted;
+
+    for (size_t done = 0; done < received.size();) {
+      const ssize_t n =
+          read(fds[0], received.data() + done, received.size() - done);
+      if (n <= 0) {
+        throw std::runtime_error("the stream ended early");
+      }
+      done += static_cast<size_t>(n);
+    }
+    producer.join();
+    output.flush();
+  }
+  std::fclose(sink);
+  close(fds[0]);
+
+  if (stalled_at > options.max_pending_frames) {
+    throw std::runtime_error(
+        fmt::format("{} frames submitted into a stalled stream, at most {} "
+                    "may be pending",
+                    stalled_at, options.max_pending_frames));
+  }
+  for (size_t i = 0; i < frames; ++i) {
+    // b, g, r, a of the frame's first pixel.
+    if (received[i * frame_size + 2] != i) {
+      throw std::runtime_error(fmt::format("frame {} is out of order", i));
+    }
+  }
+  fmt::println("{} frames streamed, {} submitted while stalled", frames,
+               stalled_at);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) try {
+  if (argc != 2) {
+    fmt::println(stderr, "usage: driver <format> | --slow-sink");
+    return 1;
+  }
+  const std::string_view name = argv[1];
+  if (name == "--slow-sink") {
+    slow_sink();
+    return 0;
+  }
+
+  const auto format = parse_image_format(name);
+  if (!format) {
+    fmt::println(stderr, "error: unknown format {}", name);
+    return 1;
+  }
+
+  const std::vector<uint8_t> bytes =
+      encode_image(*format, image, width, height);
+  dump(bytes);
+  return 0;
+} catch (const std::exception &e) {
+  fmt::println(stderr, "error: {}", e.what());
+  return 1;
+}
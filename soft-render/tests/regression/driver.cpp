@@ -0,0 +1,932 @@
+// Renders a reference scene headless and checks it against a golden image
+// (correctness gate) and a recorded frame time budget (speed gate).
+//
+// Usage: driver --scene <name> --golden <dir> [options]
+//
+//   --tolerance <n>     max per-channel difference of a matching pixel (2)
+//   --max-mismatch <p>  percent of pixels allowed to exceed the tolerance
+//                       (0.5), it absorbs ulp-level changes that flip single
+//                       pixels on shadow edges and silhouettes
+//   --budget-slack <p>  percent the frame time may exceed the budget by (25)
+//   --runs <n>          frames to time, the fastest one counts (5)
+//   --pipeline <name>   render with this pipeline (megakernel), every pipeline
+//                       is checked against the same golden image and budget
+//   --workers <spec>    render on worker threads laid out by the spec (see
+//                       parse_worker_topology()), single threaded by default
+//   --math <name>       shade with this math (exact), see shading_math_t
+//   --math-report       render with the exact and the fast math and report the
+//                       error of the fast one against the exact one and the
+//                       speedup, no golden image or budget checks
+//   --shadows <name>    trace shadow rays (traced) or look them up in the
+//                       visibility cache (cached), reports its size, builds
+//                       and the objects moved since the last build
+//   --async             render through render_async(): every frame pre-empts
+//                       an obsolete one and is collected tile by tile
+//   --tiles <order>     dispatch tiles in this order (scanline), see
+//                       tile_order_t
+//   --layout <name>     render into a linear (default) or a tiled frame
+//                       buffer, a tiled one is detiled after every frame
+//   --focus <x,y>       render the tiles nearest to this point of the frame
+//                       ((0.5,0.5) is the centre) first, see
+//                       render_priority_t, and report how the tiles of the
+//                       last frame were rendered
+//   --periphery <r>     like --focus (the centre by default), and tiles
+//                       farther than r from it are traced at half the rows
+//   --deadline <ms>     like --focus, and tiles that haven't started this
+//                       long after the frame did are skipped
+//   --perf              report the cache misses per frame from the hardware
+//                       counters, where the kernel provides them
+//   --record            overwrite the golden image and the budget instead
+//
+// The golden directory has <scene>.ppm and <scene>.budget (milliseconds). On
+// mismatch the rendered frame is written to <scene>.actual.ppm in the current
+// directory.
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <fmt/format.h>
+
+#include <soft-render/framebuffer.hpp>
+#include <soft-render/output.hpp>
+#include <soft-render/render.hpp>
+#include <soft-render/worker_topology.hpp>
+
+using namespace soft_render;
+
+namespace {
+
+constexpr size_t canvas_width = 128;
+constexpr size_t canvas_height = 128;
+
+struct reference_t {
+  std::string_view name;
+  render_quality_t quality = render_quality_t::full;
+  std::function<scene_t()> scene;
+  std::function<viewport_size_t()> viewport = [] { return viewport_size_t(); };
+  /// Applied between the first and the second frame, the second is compared.
+  std::function<void(scene_t &)> update = {};
+  /// If set, the canvas is split into vertical strips, one per viewport, and
+  /// they are rendered in one multi-view pass. `viewport` isn't used.
+  std::function<std::vector<viewport_size_t>()> split = {};
+  /// If set, the single view is this much of the canvas at its top left, the
+  /// rest stays black.
+  std::optional<canvas_size_t> canvas = {};
+};
+
+scene_t demo_scene() {
+  return {
+      .lights =
+          {
+              ambient_light_t{.intensity = 0.2f},
+              point_light_t{.intensity = 0.6f, .position = {2.0f, 1.0f, 0.0f}},
+              directional_light_t{.intensity = 0.2f,
+                                  .direction = {1.0f, 4.0f, 4.0f}},
+          },
+      .objects =
+          {
+              {.color = mfb_color::red(),
+               .position = glm::vec3(0, -1, 3),
+               .radius = 1.0f,
+               .specular = 500.0f,
+               .reflective = 0.2f},
+              {.color = mfb_color::blue(),
+               .position = glm::vec3(2, 0, 4),
+               .radius = 1.0f,
+               .specular = 500.0f,
+               .reflective = 0.3f},
+              {.color = mfb_color::green(),
+               .position = glm::vec3(-2, 0, 4),
+               .radius = 1.0f,
+               .specular = 10.0f,
+               .reflective = 0.4f},
+              {.color = mfb_color::yello(),
+               .position = glm::vec3(0, -5001, 0),
+               .radius = 5000.0f,
+               .specular = 1000.0f,
+               .reflective = 0.5f},
+          },
+  };
+}
+
+/// Many small spheres over the ground: it's the acceleration structure case.
+scene_t grid_scene() {
+  scene_t scene = demo_scene();
+  // Keep the ground only.
+  scene.objects.erase(scene.objects.begin(), scene.objects.end() - 1);
+  const mfb_color colors[] = {mfb_color::red(), mfb_color::green(),
+                              mfb_color::blue(), mfb_color::yello()};
+  for (int z = 0; z < 12; ++z) {
+    for (int x = 0; x < 12; ++x) {
+      scene.objects.push_back(
+          {.color = colors[(x + z) % 4],
+           .position = glm::vec3(-3.3f + 0.6f * x, -0.75f, 3.0f + 0.6f * z),
+           .radius = 0.25f,
+           .specular = (x % 2) ? 100.0f : -1.0f,
+           .reflective = (z % 3) * 0.2f});
+    }
+  }
+  scene.lights.push_back(
+      point_light_t{.intensity = 0.3f, .position = {-2.0f, 2.0f, 6.0f}});
+  return scene;
+}
+
+/**
+ * A quarter million small spheres: the geometry and the BVH are several times
+ * the L2 cache, it's the memory bandwidth case.
+ */
+scene_t field_scene() {
+  scene_t scene = demo_scene();
+  // Keep the ground only.
+  scene.objects.erase(scene.objects.begin(), scene.objects.end() - 1);
+  const mfb_color colors[] = {mfb_color::red(), mfb_color::green(),
+                              mfb_color::blue(), mfb_color::yello()};
+  constexpr int side = 512;
+  for (int z = 0; z < side; ++z) {
+    for (int x = 0; x < side; ++x) {
+      // Uneven heights, so rays pass between the spheres of a row.
+      const float lift = 0.1f * static_cast<float>((x * 7 + z * 13) % 5);
+      scene.objects.push_back(
+          {.color = colors[(x + z) % 4],
+           .position = glm::vec3(-32.0f + 0.125f * x, -0.95f + lift,
+                                 2.0f + 0.125f * z),
+           .radius = 0.05f,
+           .specular = (x % 2) ? 100.0f : -1.0f});
+    }
+  }
+  return scene;
+}
+
+/// The grid lit by many short range lights, it's the light grid case.
+scene_t lights_scene() {
+  scene_t scene = grid_scene();
+  scene.lights.pop_back();
+  for (int z = 0; z < 8; ++z) {
+    for (int x = 0; x < 8; ++x) {
+      scene.lights.push_back(point_light_t{
+          .intensity = 0.5f,
+          .position = glm::vec3(-3.5f + 1.0f * x, 0.0f, 3.0f + 1.0f * z),
+          .range = 1.5f});
+    }
+  }
+  return scene;
+}
+
+/**
+ * The grid made of instances of a single sphere with material overrides. It
+ * must render the grid's picture.
+ */
+scene_t instanced_grid_scene() {
+  const scene_t grid = grid_scene();
+  scene_t scene = grid;
+  scene.objects.resize(1);
+  scene.add_prototype({.objects = {{.color = {},
+                                    .position = glm::vec3(0.0f),
+                                    .radius = 0.25f}}});
+  for (size_t i = 1; i < grid.objects.size(); ++i) {
+    const sphere_t &object = grid.objects[i];
+    scene.add_instance(
+        {.transform = glm::translate(glm::mat4(1.0f), object.position),
+         .material = material_t::of(object)});
+  }
+  return scene;
+}
+
+/**
+ * Rotated, scaled and stretched copies of a small cluster of spheres. Every
+ * fifth one overrides the cluster's materials.
+ */
+scene_t instances_scene() {
+  scene_t scene = demo_scene();
+  // Keep the ground only.
+  scene.objects.erase(scene.objects.begin(), scene.objects.end() - 1);
+  scene.add_prototype({.objects = {
+                           {.color = mfb_color::red(),
+                            .position = glm::vec3(0.0f, 0.0f, 0.0f),
+                            .radius = 0.2f,
+                            .specular = 100.0f,
+                            .reflective = 0.3f},
+                           {.color = mfb_color::green(),
+                            .position = glm::vec3(0.25f, 0.0f, 0.0f),
+                            .radius = 0.1f,
+                            .specular = -1.0f,
+                            .reflective = 0.0f},
+                           {.color = mfb_color::blue(),
+                            .position = glm::vec3(0.0f, 0.25f, 0.0f),
+                            .radius = 0.1f,
+                            .specular = 10.0f,
+                            .reflective = 0.0f},
+                       }});
+  for (int z = 0; z < 10; ++z) {
+    for (int x = 0; x < 10; ++x) {
+      const int i = z * 10 + x;
+      glm::mat4 transform = glm::translate(
+          glm::mat4(1.0f),
+          glm::vec3(-3.0f + 0.65f * x, -0.7f, 3.0f + 0.65f * z));
+      transform = glm::rotate(transform, glm::radians(17.0f * i),
+                              glm::vec3(0.0f, 1.0f, 0.0f));
+      const glm::vec3 scale = i % 7 == 0
+                                  ? glm::vec3(1.5f, 0.7f, 1.0f)
+                                  : glm::vec3(0.8f + 0.05f * (i % 5));
+      transform = glm::scale(transform, scale);
+      scene.add_instance(
+          {.transform = transform,
+           .material = i % 5 == 0 ? std::optional(material_t{
+                                        .color = mfb_color::yello(),
+                                        .specular = 500.0f,
+                                        .reflective = 0.5f})
+                                  : std::nullopt});
+    }
+  }
+  return scene;
+}
+
+viewport_size_t moved_viewport() {
+  viewport_size_t viewport;
+  viewport.position = glm::vec3(1.0f, 0.5f, -1.0f);
+  viewport.rotate(glm::vec2(10.0f, -15.0f));
+  return viewport;
+}
+
+/// The top half of the canvas.
+const canvas_size_t wide_canvas = {
+    .width = pixel_coordinate_t(canvas_width),
+    .height = pixel_coordinate_t(canvas_height / 2)};
+
+/// Half as high as wide, like wide_canvas.
+viewport_size_t wide_viewport() {
+  viewport_size_t viewport;
+  viewport.height = 0.5f;
+  return viewport;
+}
+
+/// Two eyes side by side, each gets a half of the canvas.
+std::vector<viewport_size_t> stereo_viewports() {
+  std::vector<viewport_size_t> eyes(2);
+  for (size_t i = 0; i < eyes.size(); ++i) {
+    eyes[i].width = 0.5f;
+    eyes[i].position = glm::vec3(i == 0 ? -0.1f : 0.1f, 0.0f, 0.0f);
+  }
+  return eyes;
+}
+
+const std::vector<reference_t> &references() {
+  static const std::vector<reference_t> references = {
+      {.name = "demo", .scene = demo_scene},
+      {.name = "demo-moved", .scene = demo_scene, .viewport = moved_viewport},
+      {.name = "demo-bounce",
+       .scene = demo_scene,
+       .update =
+           [](scene_t &scene) {
+             // The small spheres move like the window animates them: a few
+             // moved objects, the visibility cache keeps its trees.
+             for (size_t i = 0; i < 3; ++i) {
+               scene.translate(i, glm::vec3(0.0f, 0.3f, 0.0f));
+             }
+           }},
+      {.name = "demo-preview",
+       .quality = render_quality_t::preview,
+       .scene = demo_scene},
+      {.name = "demo-draft",
+       .quality = render_quality_t::draft,
+       .scene = demo_scene},
+      {.name = "grid", .scene = grid_scene, .viewport = moved_viewport},
+      {.name = "grid-dynamic",
+       .scene = grid_scene,
+       .viewport = moved_viewport,
+       .update =
+           [](scene_t &scene) {
+             // Lift every other sphere, it goes through the BVH refit.
+             for (size_t i = 1; i < scene.objects.size(); i += 2) {
+               scene.translate(i, glm::vec3(0.0f, 0.5f, 0.0f));
+             }
+             scene.set_radius(2, 0.4f);
+           }},
+      {.name = "demo-stereo", .scene = demo_scene, .split = stereo_viewports},
+      // A wide canvas: the view is centred vertically on the height, not the
+      // width.
+      {.name = "demo-wide",
+       .scene = demo_scene,
+       .viewport = wide_viewport,
+       .canvas = wide_canvas},
+      {.name = "lights", .scene = lights_scene, .viewport = moved_viewport},
+      {.name = "field", .scene = field_scene, .viewport = moved_viewport},
+      {.name = "grid-instanced",
+       .scene = instanced_grid_scene,
+       .viewport = moved_viewport},
+      {.name = "instances",
+       .scene = instances_scene,
+       .viewport = moved_viewport,
+       .update =
+           [](scene_t &scene) {
+             // Lift every third copy, it goes through the top level refit.
+             for (size_t i = 0; i < scene.instances.size(); i += 3) {
+               scene.set_transform(
+                   i, glm::translate(glm::mat4(1.0f),
+                                     glm::vec3(0.0f, 0.4f, 0.0f)) *
+                          scene.instances[i].transform);
+             }
+           }},
+  };
+  return references;
+}
+
+struct options_t {
+  std::string scene;
+  std::string golden;
+  int tolerance = 2;
+  double max_mismatch = 0.5;
+  double budget_slack = 25.0;
+  size_t runs = 5;
+  render_pipeline_t pipeline = render_pipeline_t::megakernel;
+  std::optional<worker_topology_t> workers;
+  shading_math_t math = shading_math_t::exact;
+  bool math_report = false;
+  shadow_mode_t shadows = shadow_mode_t::traced;
+  tile_order_t tile_order = tile_order_t::scanline;
+  pixel_layout_t layout = pixel_layout_t::linear;
+  std::optional<render_priority_t> priority;
+  bool async = false;
+  bool perf = false;
+  bool record = false;
+};
+
+template <typename T> bool parse_number(std::string_view value, T &result) {
+  const auto [end, ec] =
+      std::from_chars(value.data(), value.data() + value.size(), result);
+  return ec == std::errc() && end == value.data() + value.size();
+}
+
+std::optional<options_t> parse_options(int argc, char *argv[]) {
+  options_t options;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg == "--record") {
+      options.record = true;
+      continue;
+    }
+    if (arg == "--async") {
+      options.async = true;
+      continue;
+    }
+    if (arg == "--math-report") {
+      options.math_report = true;
+      continue;
+    }
+    if (arg == "--perf") {
+      options.perf = true;
+      continue;
+    }
+    if (i + 1 == argc) {
+      fmt::println(stderr, "error: missing value for {}", arg);
+      return std::nullopt;
+    }
+    const std::string_view value = argv[++i];
+
+    bool valid = true;
+    if (arg == "--scene") {
+      options.scene = value;
+    } else if (arg == "--golden") {
+      options.golden = value;
+    } else if (arg == "--tolerance") {
+      valid = parse_number(value, options.tolerance);
+    } else if (arg == "--max-mismatch") {
+      valid = parse_number(value, options.max_mismatch);
+    } else if (arg == "--budget-slack") {
+      valid = parse_number(value, options.budget_slack);
+    } else if (arg == "--runs") {
+      valid = parse_number(value, options.runs) && options.runs != 0;
+    } else if (arg == "--pipeline") {
+      const auto pipeline = parse_render_pipeline(value);
+      valid = pipeline.has_value();
+      options.pipeline = pipeline.value_or(options.pipeline);
+    } else if (arg == "--workers") {
+      options.workers = parse_worker_topology(value);
+      valid = options.workers.has_value();
+    } else if (arg == "--math") {
+      const auto math = parse_shading_math(value);
+      valid = math.has_value();
+      options.math = math.value_or(options.math);
+    } else if (arg == "--shadows") {
+      const auto shadows = parse_shadow_mode(value);
+      valid = shadows.has_value();
+      options.shadows = shadows.value_or(options.shadows);
+    } else if (arg == "--focus" || arg == "--periphery" ||
+               arg == "--deadline") {
+      render_priority_t &priority =
+          options.priority ? *options.priority : options.priority.emplace();
+      if (arg == "--focus") {
+        const auto comma = value.find(',');
+        valid = comma != std::string_view::npos &&
+                parse_number(value.substr(0, comma), priority.focus.x) &&
+                parse_number(value.substr(comma + 1), priority.focus.y);
+      } else if (arg == "--periphery") {
+        valid = parse_number(value, priority.full_radius);
+      } else {
+        unsigned milliseconds = 0;
+        valid = parse_number(value, milliseconds);
+        priority.deadline = std::chrono::milliseconds(milliseconds);
+      }
+    } else if (arg == "--tiles") {
+      const auto order = parse_tile_order(value);
+      valid = order.has_value();
+      options.tile_order = order.value_or(options.tile_order);
+    } else if (arg == "--layout") {
+      const auto layout = parse_pixel_layout(value);
+      valid = layout.has_value();
+      options.layout = layout.value_or(options.layout);
+    } else {
+      fmt::println(stderr, "error: unknown option {}", arg);
+      return std::nullopt;
+    }
+    if (!valid) {
+      fmt::println(stderr, "error: invalid value {} for {}", value, arg);
+      return std::nullopt;
+    }
+  }
+
+  if (options.scene.empty() || options.golden.empty()) {
+    fmt::println(stderr, "error: --scene and --golden are required");
+    return std::nullopt;
+  }
+  return options;
+}
+
+std::optional<std::string> read_file(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return std::nullopt;
+  }
+  return std::string(std::istreambuf_iterator<char>(file), {});
+}
+
+void write_file(const std::string &path, std::string_view data) {
+  std::ofstream file(path, std::ios::binary);
+  file.write(data.data(), static_cast<std::streamsize>(data.size()));
+  if (!file) {
+    throw std::runtime_error(fmt::format("unable to write {}", path));
+  }
+}
+
+void write_ppm(const std::string &path, const std::vector<mfb_color> &frame) {
+  const auto bytes =
+      encode_image(image_format_t::ppm, frame, canvas_width, canvas_height);
+  write_file(path,
+             {reinterpret_cast<const char *>(bytes.data()), bytes.size()});
+}
+
+/// Reads what encode_image() writes for PPM, nothing more.
+std::optional<std::vector<mfb_color>> read_ppm(const std::string &path) {
+  const auto data = read_file(path);
+  if (!data) {
+    return std::nullopt;
+  }
+  const std::string header =
+      fmt::format("P6\n{} {}\n255\n", canvas_width, canvas_height);
+  if (data->size() != header.size() + canvas_width * canvas_height * 3 ||
+      data->compare(0, header.size(), header) != 0) {
+    throw std::runtime_error(
+        fmt::format("{} is not a {}x{} binary PPM", path, canvas_width,
+                    canvas_height));
+  }
+
+  std::vector<mfb_color> frame(canvas_width * canvas_height);
+  const auto *rgb =
+      reinterpret_cast<const unsigned char *>(data->data() + header.size());
+  for (auto &pixel : frame) {
+    pixel = {.b = rgb[2], .g = rgb[1], .r = rgb[0]};
+    rgb += 3;
+  }
+  return frame;
+}
+
+/**
+ * Renders the views like renderer::render(), through the asynchronous API.
+ * A frame of the scene as it is now is started and pre-empted by the real one.
+ */
+void render_async(renderer &r, std::span<const render_view_t> views,
+                  const scene_t &scene) {
+  const render_job obsolete = r.render_async(views, scene);
+  render_job job = r.render_async(views, scene);
+
+  size_t pixels = 0;
+  for (const render_view_t &view : views) {
+    pixels += view.canvas_size.width.as_size() *
+              view.canvas_size.height.as_size();
+  }
+  while (const auto tile = job.next()) {
+    pixels -= tile->rows * tile->columns;
+  }
+  if (pixels != 0 || job.cancelled() || !obsolete.done()) {
+    throw std::runtime_error("render_async() lost tiles");
+  }
+}
+
+/// Cache misses of the process, over all threads.
+struct cache_misses_t {
+  uint64_t l1d = 0;
+  uint64_t llc = 0;
+};
+
+/**
+ * Hardware counters of the L1 data cache and the last level cache read misses.
+ * Threads created after the counters inherit them, so they have to be opened
+ * before the renderer starts its workers. Linux only, and the kernel may not
+ * allow them (perf_event_paranoid, containers): then there are no counts.
+ */
+class cache_counters_t {
+public:
+  cache_counters_t() {
+#ifdef __linux__
+    l1d_ = open(PERF_TYPE_HW_CACHE,
+                PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                    PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    llc_ = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+  }
+
+  cache_counters_t(const cache_counters_t &) = delete;
+  cache_counters_t &operator=(const cache_counters_t &) = delete;
+
+  ~cache_counters_t() {
+#ifdef __linux__
+    for (const int fd : {l1d_, llc_}) {
+      if (fd != -1) {
+        close(fd);
+      }
+    }
+#endif
+  }
+
+  [[nodiscard]] bool available() const noexcept {
+    return l1d_ != -1 && llc_ != -1;
+  }
+
+  void enable() const noexcept { control(true); }
+  void disable() const noexcept { control(false); }
+
+  [[nodiscard]] std::optional<cache_misses_t> read() const noexcept {
+#ifdef __linux__
+    cache_misses_t misses;
+    if (available() &&
+        ::read(l1d_, &misses.l1d, sizeof(misses.l1d)) == sizeof(misses.l1d) &&
+        ::read(llc_, &misses.llc, sizeof(misses.llc)) == sizeof(misses.llc)) {
+      return misses;
+    }
+#endif
+    return std::nullopt;
+  }
+
+private:
+#ifdef __linux__
+  static int open(uint32_t type, uint64_t config) noexcept {
+    perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    // User space only, allowed with the default perf_event_paranoid.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(
+        syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+#endif
+
+  void control(bool enable) const noexcept {
+#ifdef __linux__
+    if (available()) {
+      const auto request =
+          enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE;
+      ioctl(l1d_, request, 0);
+      ioctl(llc_, request, 0);
+    }
+#else
+    static_cast<void>(enable);
+#endif
+  }
+
+  int l1d_ = -1;
+  int llc_ = -1;
+};
+
+/// Tiles of a prioritized frame by how they were rendered.
+struct tile_counts_t {
+  size_t full = 0;
+  size_t reduced = 0;
+  size_t expired = 0;
+};
+
+struct frame_result_t {
+  std::vector<mfb_color> frame;
+  double best_ms = 0.0;
+  /// Per frame, over all the timed runs. With --perf only.
+  std::optional<cache_misses_t> misses;
+  /// Visibility cache nodes, builds and moved objects. With --shadows cached
+  /// only.
+  size_t visibility_nodes = 0;
+  size_t visibility_builds = 0;
+  size_t visibility_moved = 0;
+  /// Of the last frame. With a priority only.
+  std::optional<tile_counts_t> tiles;
+};
+
+frame_result_t render(const reference_t &reference, const options_t &options) {
+  scene_t scene = reference.scene();
+  frame_result_t result;
+  result.frame.resize(canvas_width * canvas_height);
+
+  std::vector<render_view_t> views;
+  if (reference.split) {
+    const auto viewports = reference.split();
+    const size_t width = canvas_width / viewports.size();
+    for (size_t i = 0; i < viewports.size(); ++i) {
+      const canvas_size_t strip = {.width = pixel_coordinate_t(width),
+                                   .height = pixel_coordinate_t(canvas_height)};
+      views.push_back(render_view_t::rect(result.frame, canvas_width,
+                                          i * width, 0, strip, viewports[i]));
+    }
+  } else if (reference.canvas) {
+    views.push_back(render_view_t::rect(result.frame, canvas_width, 0, 0,
+                                        *reference.canvas,
+                                        reference.viewport()));
+  } else {
+    const canvas_size_t canvas_size = {
+        .width = pixel_coordinate_t(canvas_width),
+        .height = pixel_coordinate_t(canvas_height)};
+    views.push_back(
+        render_view_t::whole(result.frame, canvas_size, reference.viewport()));
+  }
+
+  std::optional<cache_counters_t> counters;
+  if (options.perf) {
+    counters.emplace();
+  }
+  renderer r(options.workers.value_or(worker_topology_t::single(1)));
+  if (options.workers) {
+    r.enable_mt();
+  }
+  r.set_quality(reference.quality);
+  r.set_pipeline(options.pipeline);
+  r.set_math(options.math);
+  r.set_shadows(options.shadows);
+  r.set_tile_order(options.tile_order);
+  r.set_priority(options.priority);
+
+  // A tiled buffer per view, detiled to the frame like a window would be.
+  std::vector<framebuffer_t> tiled_buffers;
+  std::vector<render_view_t> tiled_views;
+  if (options.layout == pixel_layout_t::tiled) {
+    for (const render_view_t &view : views) {
+      framebuffer_t &buffer = tiled_buffers.emplace_back(
+          r.make_framebuffer(view.canvas_size, pixel_layout_t::tiled));
+      tiled_views.push_back(render_view_t::tiled(
+          buffer.pixels(), view.canvas_size, view.viewport_size));
+    }
+  }
+  const auto render_frame = [&] {
+    const std::span<const render_view_t> targets =
+        tiled_views.empty() ? views : tiled_views;
+    if (options.async) {
+      render_async(r, targets, scene);
+    } else if (options.priority) {
+      render_job job = r.render_async(targets, scene);
+      tile_counts_t &tiles = result.tiles.emplace();
+      while (const auto tile = job.next()) {
+        ++(tile->reduced ? tiles.reduced : tiles.full);
+      }
+      tiles.expired = job.expired();
+    } else {
+      r.render(targets, scene);
+    }
+    for (size_t v = 0; v < tiled_buffers.size(); ++v) {
+      tiled_layout_t::of(views[v].canvas_size)
+          .detile(tiled_buffers[v].pixels(), views[v].target, views[v].stride);
+    }
+  };
+  if (reference.update) {
+    render_frame();
+    reference.update(scene);
+  }
+
+  result.best_ms = std::numeric_limits<double>::infinity();
+  if (counters) {
+    counters->enable();
+  }
+  for (size_t i = 0; i < options.runs; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    render_frame();
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    result.best_ms = std::min(result.best_ms, elapsed.count());
+  }
+  if (counters) {
+    counters->disable();
+    result.misses = counters->read();
+    if (result.misses) {
+      result.misses->l1d /= options.runs;
+      result.misses->llc /= options.runs;
+    }
+  }
+  result.visibility_nodes = r.visibility_cache().size();
+  result.visibility_builds = r.visibility_cache().builds();
+  result.visibility_moved = r.visibility_cache().moved().size();
+  return result;
+}
+
+struct frame_difference_t {
+  /// Pixels with a channel off by more than the tolerance.
+  size_t mismatched = 0;
+  int max_difference = 0;
+  /// Per channel.
+  double mean_difference = 0.0;
+  /// Peak signal to noise ratio, infinity for equal frames.
+  double psnr = std::numeric_limits<double>::infinity();
+
+  [[nodiscard]] double mismatch_percent(size_t pixels) const noexcept {
+    return 100.0 * static_cast<double>(mismatched) /
+           static_cast<double>(pixels);
+  }
+};
+
+frame_difference_t compare_frames(std::span<const mfb_color> actual,
+                                  std::span<const mfb_color> expected,
+                                  int tolerance) {
+  frame_difference_t result;
+  double sum = 0.0;
+  double sum_squares = 0.0;
+  for (size_t i = 0; i < actual.size(); ++i) {
+    const auto &a = actual[i];
+    const auto &b = expected[i];
+    const int channels[] = {std::abs(a.r - b.r), std::abs(a.g - b.g),
+                            std::abs(a.b - b.b)};
+    const int difference = std::max({channels[0], channels[1], channels[2]});
+    result.max_difference = std::max(result.max_difference, difference);
+    if (difference > tolerance) {
+      ++result.mismatched;
+    }
+    for (const int channel : channels) {
+      sum += channel;
+      sum_squares += channel * channel;
+    }
+  }
+  const auto samples = static_cast<double>(actual.size() * 3);
+  result.mean_difference = sum / samples;
+  if (sum_squares > 0.0) {
+    result.psnr = 10.0 * std::log10(255.0 * 255.0 * samples / sum_squares);
+  }
+  return result;
+}
+
+/// Fast math against the exact one on the scene, see --math-report.
+int report_math(const reference_t &reference, const options_t &options) {
+  options_t exact_options = options;
+  exact_options.math = shading_math_t::exact;
+  options_t fast_options = options;
+  fast_options.math = shading_math_t::fast;
+  const frame_result_t exact = render(reference, exact_options);
+  const frame_result_t fast = render(reference, fast_options);
+
+  const frame_difference_t difference =
+      compare_frames(fast.frame, exact.frame, options.tolerance);
+  fmt::println("{}: fast math: max difference {}, {} pixels ({:.3f}%) "
+               "differ by more than {}, mean difference {:.4f}, PSNR {:.1f} "
+               "dB; {:.3f} ms exact, {:.3f} ms fast ({:.2f}x)",
+               options.scene, difference.max_difference,
+               difference.mismatched,
+               difference.mismatch_percent(fast.frame.size()),
+               options.tolerance, difference.mean_difference,
+               difference.psnr, exact.best_ms, fast.best_ms,
+               exact.best_ms / fast.best_ms);
+  return 0;
+}
+
+int run(const options_t &options) {
+  const auto &all = references();
+  const auto reference =
+      std::find_if(all.begin(), all.end(), [&](const reference_t &r) {
+        return r.name == options.scene;
+      });
+  if (reference == all.end()) {
+    fmt::println(stderr, "error: unknown scene {}", options.scene);
+    return 1;
+  }
+
+  if (options.math_report) {
+    return report_math(*reference, options);
+  }
+
+  const std::string golden = options.golden + "/" + options.scene;
+  const frame_result_t result = render(*reference, options);
+
+  if (options.perf) {
+    if (result.misses) {
+      fmt::println("{}: {} L1d read misses, {} LLC misses per frame",
+                   options.scene, result.misses->l1d, result.misses->llc);
+    } else {
+      fmt::println("{}: cache counters are not available", options.scene);
+    }
+  }
+
+  if (result.tiles) {
+    fmt::println("{}: {} full, {} reduced and {} expired tiles",
+                 options.scene, result.tiles->full, result.tiles->reduced,
+                 result.tiles->expired);
+  }
+  if (options.shadows == shadow_mode_t::cached) {
+    fmt::println("{}: visibility cache: {} nodes, {} builds, {} moved",
+                 options.scene, result.visibility_nodes,
+                 result.visibility_builds, result.visibility_moved);
+  }
+
+  if (options.record) {
+    write_ppm(golden + ".ppm", result.frame);
+    write_file(golden + ".budget", fmt::format("{:.3f}\n", result.best_ms));
+    fmt::println("{}: recorded, {:.3f} ms", options.scene, result.best_ms);
+    return 0;
+  }
+
+  bool passed = true;
+
+  const auto expected = read_ppm(golden + ".ppm");
+  if (!expected) {
+    fmt::println(stderr, "error: {}: no golden image {}.ppm", options.scene,
+                 golden);
+    return 1;
+  }
+  const frame_difference_t difference =
+      compare_frames(result.frame, *expected, options.tolerance);
+  const double mismatch_percent =
+      difference.mismatch_percent(result.frame.size());
+  if (mismatch_percent > options.max_mismatch) {
+    fmt::println(stderr,
+                 "error: {}: {} pixels ({:.3f}%) differ by more than {}, "
+                 "max difference {}",
+                 options.scene, difference.mismatched, mismatch_percent,
+                 options.tolerance, difference.max_difference);
+    write_ppm(options.scene + ".actual.ppm", result.frame);
+    passed = false;
+  }
+
+#ifdef __OPTIMIZE__
+  if (const auto budget_text = read_file(golden + ".budget")) {
+    double budget_ms = 0.0;
+    const std::string_view text(*budget_text);
+    const auto end = text.find_last_not_of(" \n");
+    if (!parse_number(text.substr(0, end + 1), budget_ms)) {
+      fmt::println(stderr, "error: {}: invalid budget {}.budget",
+                   options.scene, golden);
+      return 1;
+    }
+    const double limit_ms = budget_ms * (1.0 + options.budget_slack / 100.0);
+    if (result.best_ms > limit_ms) {
+      fmt::println(stderr,
+                   "error: {}: frame took {:.3f} ms, budget is {:.3f} ms "
+                   "+{}% = {:.3f} ms",
+                   options.scene, result.best_ms, budget_ms,
+                   options.budget_slack, limit_ms);
+      passed = false;
+    }
+  }
+#else
+  // Unoptimized builds have nothing to do with the recorded budgets.
+#endif
+
+  return passed ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) try {
+  const std::optional<options_t> options = parse_options(argc, argv);
+  if (!options) {
+    return 1;
+  }
+  return run(*options);
+} catch (const std::exception &e) {
+  fmt::println(stderr, "error: {}", e.what());
+  return 1;
+}